@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "driver.hpp"
+
+// Front-end throughput benchmark. Generates a synthetic program of a given shape
+// and size, runs every compiler phase over it a few times and prints the median
+// time and throughput of each phase as JSON. Programs are generated from a fixed
+// seed, so the same arguments always measure the same input.
+
+// xorshift64*, so programs don't depend on the standard library's distributions
+class Random {
+public:
+    inline explicit Random(uint64_t seed)
+        : m_state(seed | 1)
+    {
+    }
+
+    inline uint64_t next(uint64_t bound)
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return (m_state * 0x2545F4914F6CDD1D) % bound;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+class ProgramGenerator {
+public:
+    inline ProgramGenerator(uint64_t seed, size_t depth)
+        : m_random(seed)
+        , m_depth(depth)
+    {
+    }
+
+    // `size` statements, each a `let` whose value nests `depth` parentheses deep
+    std::string deep(size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            append("let d", std::to_string(i), " = ");
+            nested(m_depth);
+            m_out += ";\n";
+        }
+        return finish();
+    }
+
+    // `size` `let`s, each reading two earlier ones
+    std::string lets(size_t size)
+    {
+        m_out += "let v0 = 1;\n";
+        for (size_t i = 1; i < size; i++) {
+            std::string a = std::to_string(m_random.next(i));
+            std::string b = std::to_string(m_random.next(i));
+            std::string operation = op();
+            append("let v", std::to_string(i), " = v", a, " ", operation, " v", b, " + ", literal(), ";\n");
+        }
+        return finish();
+    }
+
+    // scopes of up to 256 statements, nested a few levels, with `if`s between them
+    std::string wide(size_t size)
+    {
+        size_t count = 0;
+        while (count < size) {
+            append("if (", literal(), ") {\n");
+            m_out += "{\n";
+            for (size_t i = 0; i < 256 && count < size; i++, count++) {
+                std::string lhs = literal();
+                std::string operation = op();
+                append("let w", std::to_string(count), " = ", lhs, " ", operation, " ", literal(), ";\n");
+            }
+            m_out += "}\n}\n";
+        }
+        return finish();
+    }
+
+    // `size` functions of a few parameters and statements each, every one calling
+    // the one before it, and a call to the last
+    std::string functions(size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            append("function f", std::to_string(i), "(a, b, c) {\n");
+            std::string x_op = op();
+            append("    let x = a ", x_op, " b + ", literal(), ";\n");
+            std::string y_op = op();
+            append("    let y = x * c ", y_op, " (a + ", literal(), ");\n");
+            if (i == 0) {
+                m_out += "    return y;\n}\n";
+            }
+            else {
+                std::string return_op = op();
+                append("    return y ", return_op, " f", std::to_string(i - 1), "(x, y, c + ", literal(), ");\n}\n");
+            }
+        }
+        if (size != 0) {
+            append("exit(f", std::to_string(size - 1), "(1, 2, 3));\n");
+        }
+        return finish();
+    }
+
+private:
+    void nested(size_t depth)
+    {
+        if (depth == 0) {
+            m_out += literal();
+            return;
+        }
+        std::string lhs = literal();
+        std::string operation = op();
+        append("(", lhs, " ", operation, " ");
+        nested(depth - 1);
+        m_out += ")";
+    }
+
+    // Appends `parts` to the program in order. Arguments are evaluated in no set
+    // order, so callers draw from m_random beforehand when it matters.
+    template <typename... Parts>
+    void append(const Parts&... parts)
+    {
+        (m_out.append(parts), ...);
+    }
+
+    // never a division, so folding never has to leave a division by zero alone
+    std::string op()
+    {
+        static constexpr const char* ops[] = { "+", "-", "*" };
+        return ops[m_random.next(3)];
+    }
+
+    std::string literal()
+    {
+        return std::to_string(1 + m_random.next(1000));
+    }
+
+    std::string finish()
+    {
+        m_out += "exit(0);\n";
+        return std::move(m_out);
+    }
+
+    Random m_random;
+    size_t m_depth;
+    std::string m_out;
+};
+
+struct Sample {
+    double tokenize = 0;
+    double parse = 0;
+    double fold = 0;
+    double flatten = 0;
+    double generate = 0;
+    size_t tokens = 0;
+    size_t nodes = 0;
+    size_t asm_bytes = 0;
+};
+
+template <typename Fn>
+double seconds(Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// one pass of every phase over `source`; the parser pulls its own tokens, so the
+// parse time includes tokenizing and tokenize is measured on a run of its own
+Sample run_once(std::string_view source, const GeneratorOptions& options, const CharScanner& scanner, ArenaAllocator& arena)
+{
+    Sample sample;
+    {
+        Interner symbols;
+        Tokenizer tokenizer(source, symbols, scanner);
+        std::vector<Token> tokens;
+        sample.tokenize = seconds([&] { tokens = tokenizer.tokenize(); });
+        sample.tokens = tokens.size();
+    }
+
+    arena.reset();
+    Interner symbols;
+    Tokenizer tokenizer(source, symbols, scanner);
+    Parser parser(tokenizer, arena);
+    std::optional<NodeProg> prog;
+    sample.parse = seconds([&] { prog = parser.parse_prog(); });
+
+    sample.fold = seconds([&] { ConstFolder(arena).fold_prog(prog.value()); });
+
+    FlatAst ast;
+    sample.flatten = seconds([&] { ast = flatten(prog.value()); });
+    sample.nodes = ast.nodes.size();
+
+    StringSink out;
+    sample.generate = seconds([&] {
+        Generator generator(ast.view(), options);
+        generator.gen_prog(out);
+        out.finish();
+    });
+    sample.asm_bytes = out.size();
+    return sample;
+}
+
+double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+std::optional<std::string> arg_value(int argc, char* argv[], const std::string& name)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with(name + "=")) {
+            return arg.substr(name.size() + 1);
+        }
+    }
+    return {};
+}
+
+bool has_arg(int argc, char* argv[], const std::string& name)
+{
+    for (int i = 1; i < argc; i++) {
+        if (argv[i] == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    if (has_arg(argc, argv, "--help") || has_arg(argc, argv, "-h")) {
+        std::cout << "dum_bench [--shape=deep|lets|wide|functions|all] [--size=N] [--depth=N] [--reps=N] [--seed=N] [--scanner=scalar|sse2|avx2] [-ra] [--emit=FILE]" << std::endl;
+        std::cout << "Prints the median time and throughput of each compiler phase as JSON; parse includes pulling tokens." << std::endl;
+        std::cout << "--emit=FILE writes the generated program instead, for a single shape." << std::endl;
+        return EXIT_SUCCESS;
+    }
+    std::string shape = arg_value(argc, argv, "--shape").value_or("all");
+    size_t size = std::stoul(arg_value(argc, argv, "--size").value_or("20000"));
+    size_t depth = std::stoul(arg_value(argc, argv, "--depth").value_or("32"));
+    size_t reps = std::max<size_t>(1, std::stoul(arg_value(argc, argv, "--reps").value_or("5")));
+    uint64_t seed = std::stoull(arg_value(argc, argv, "--seed").value_or("1"));
+    // most of the variables the shapes declare are never read, and dead code
+    // elimination would leave nothing to generate
+    GeneratorOptions options { .regalloc = has_arg(argc, argv, "-ra"), .eliminate_dead_code = false };
+
+    std::string scanner_name = arg_value(argc, argv, "--scanner").value_or(CharScanner::best().name);
+    const CharScanner* scanner = &CharScanner::scalar();
+#ifdef DUM_SCAN_X86
+    if (scanner_name == "sse2") {
+        scanner = &CharScanner::sse2();
+    }
+    else if (scanner_name == "avx2" && __builtin_cpu_supports("avx2")) {
+        scanner = &CharScanner::avx2();
+    }
+#endif
+    if (scanner->name != scanner_name) {
+        std::cerr << "Scanner `" << scanner_name << "` is not available." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> shapes;
+    if (shape == "all") {
+        shapes = { "deep", "lets", "wide", "functions" };
+    }
+    else if (shape == "deep" || shape == "lets" || shape == "wide" || shape == "functions") {
+        shapes = { shape };
+    }
+    else {
+        std::cerr << "Unknown shape: `" << shape << "`." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::optional<std::string> emit = arg_value(argc, argv, "--emit");
+    if (emit.has_value() && shapes.size() != 1) {
+        std::cerr << "--emit needs a single --shape." << std::endl;
+        return EXIT_FAILURE;
+    }
+    ArenaAllocator arena(1024 * 1024 * 4);
+    std::cout << "[";
+    for (size_t s = 0; s < shapes.size(); s++) {
+        ProgramGenerator generator(seed, depth);
+        std::string source = shapes[s] == "deep" ? generator.deep(size)
+            : shapes[s] == "lets"                ? generator.lets(size)
+            : shapes[s] == "wide"                ? generator.wide(size)
+                                                 : generator.functions(size);
+        if (emit.has_value()) {
+            std::ofstream(emit.value()) << source;
+            return EXIT_SUCCESS;
+        }
+
+        std::vector<Sample> samples;
+        for (size_t i = 0; i < reps; i++) {
+            samples.push_back(run_once(source, options, *scanner, arena));
+        }
+        auto phase = [&](double Sample::*field) {
+            std::vector<double> times;
+            for (const Sample& sample : samples) {
+                times.push_back(sample.*field);
+            }
+            return median(times);
+        };
+        const Sample& first = samples.front();
+        double tokenize = phase(&Sample::tokenize);
+        double parse = phase(&Sample::parse);
+        double fold = phase(&Sample::fold);
+        double flatten = phase(&Sample::flatten);
+        double generate = phase(&Sample::generate);
+        auto rate = [](double count, double time) {
+            return time > 0 ? count / time : 0.0;
+        };
+
+        std::cout << (s == 0 ? "\n" : ",\n");
+        std::cout << "  {\"shape\": \"" << shapes[s] << "\", \"size\": " << size << ", \"depth\": " << depth
+                  << ", \"reps\": " << reps << ", \"seed\": " << seed << ", \"regalloc\": " << (options.regalloc ? "true" : "false")
+                  << ", \"scanner\": \"" << scanner->name << "\",\n";
+        std::cout << "   \"source_bytes\": " << source.size() << ", \"tokens\": " << first.tokens
+                  << ", \"nodes\": " << first.nodes << ", \"asm_bytes\": " << first.asm_bytes << ",\n";
+        std::cout << "   \"phases\": {\n";
+        std::cout << "    \"tokenize\": {\"seconds\": " << tokenize << ", \"tokens_per_s\": " << rate(first.tokens, tokenize)
+                  << ", \"bytes_per_s\": " << rate(source.size(), tokenize) << "},\n";
+        std::cout << "    \"parse\": {\"seconds\": " << parse << ", \"tokens_per_s\": " << rate(first.tokens, parse) << "},\n";
+        std::cout << "    \"fold\": {\"seconds\": " << fold << ", \"nodes_per_s\": " << rate(first.nodes, fold) << "},\n";
+        std::cout << "    \"flatten\": {\"seconds\": " << flatten << ", \"nodes_per_s\": " << rate(first.nodes, flatten) << "},\n";
+        std::cout << "    \"generate\": {\"seconds\": " << generate << ", \"nodes_per_s\": " << rate(first.nodes, generate)
+                  << ", \"asm_bytes_per_s\": " << rate(first.asm_bytes, generate) << "}\n";
+        std::cout << "   }}";
+    }
+    std::cout << "\n]" << std::endl;
+    return EXIT_SUCCESS;
+}
\ No newline at end of file
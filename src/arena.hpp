@@ -1,20 +1,106 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "./compile_error.hpp"
+
+struct ArenaStats {
+    size_t bytes_used; // handed out to callers
+    size_t bytes_reserved; // sum of all chunk sizes
+    size_t chunks;
+    size_t waste; // alignment padding plus chunk tails skipped when growing
+};
+
+// Bump allocator over a chain of chunks. When the current chunk is full the next
+// one is twice as big, so a program of any size fits without reallocating what was
+// already handed out. Objects are constructed in place but never destroyed, so only
+// trivially destructible types may live here; dropping the arena frees them all at once.
 class ArenaAllocator {
 public:
+    // A position to roll back to. Chunks allocated after the mark are kept for reuse.
+    struct Mark {
+        size_t chunk;
+        std::byte* offset;
+        size_t bytes_used;
+        size_t waste;
+    };
+
     inline explicit ArenaAllocator(size_t bytes)
-        : m_size(bytes)
     {
-        m_buffer = static_cast<std::byte*>(malloc(m_size));
-        m_offset = m_buffer;
+        add_chunk(bytes);
+        m_offset = m_chunks.front().begin;
     }
 
+    template <typename T, typename... Args>
+    inline T* alloc(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        void* memory = alloc_bytes(sizeof(T), alignof(T));
+        return new (memory) T(std::forward<Args>(args)...);
+    }
+
+    // Copy `items` into one contiguous block owned by the arena.
     template <typename T>
-    inline T* alloc()
+    inline std::span<T> alloc_array(std::span<const T> items)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        if (items.empty()) {
+            return {};
+        }
+        auto memory = static_cast<T*>(alloc_bytes(sizeof(T) * items.size(), alignof(T)));
+        std::uninitialized_copy(items.begin(), items.end(), memory);
+        return { memory, items.size() };
+    }
+
+    inline void* alloc_bytes(size_t size, size_t align)
     {
-        void* offset = m_offset;
-        m_offset += sizeof(T);
-        return static_cast<T*>(offset);
+        std::byte* aligned = align_up(m_offset, align);
+        if (aligned + size > chunk_end()) {
+            next_chunk(size + align);
+            aligned = align_up(m_offset, align);
+        }
+        m_waste += aligned - m_offset;
+        m_bytes_used += size;
+        m_offset = aligned + size;
+        return aligned;
+    }
+
+    [[nodiscard]] inline Mark mark() const
+    {
+        return { .chunk = m_current, .offset = m_offset, .bytes_used = m_bytes_used, .waste = m_waste };
+    }
+
+    inline void rollback(const Mark& mark)
+    {
+        m_current = mark.chunk;
+        m_offset = mark.offset;
+        m_bytes_used = mark.bytes_used;
+        m_waste = mark.waste;
+    }
+
+    // Forget everything allocated so far but keep the chunks for the next user.
+    inline void reset()
+    {
+        rollback({ .chunk = 0, .offset = m_chunks.front().begin, .bytes_used = 0, .waste = 0 });
+    }
+
+    [[nodiscard]] inline ArenaStats stats() const
+    {
+        size_t reserved = 0;
+        for (const Chunk& chunk : m_chunks) {
+            reserved += chunk.size;
+        }
+        return { .bytes_used = m_bytes_used, .bytes_reserved = reserved, .chunks = m_chunks.size(), .waste = m_waste };
     }
 
     inline ArenaAllocator(const ArenaAllocator& other) = delete;
@@ -23,11 +109,58 @@ public:
 
     inline ~ArenaAllocator()
     {
-        free(m_buffer);
+        for (const Chunk& chunk : m_chunks) {
+            free(chunk.begin);
+        }
     }
 
 private:
-    size_t m_size;
-    std::byte* m_buffer;
+    struct Chunk {
+        std::byte* begin;
+        size_t size;
+    };
+
+    static inline std::byte* align_up(std::byte* ptr, size_t align)
+    {
+        auto addr = reinterpret_cast<uintptr_t>(ptr);
+        return ptr + ((align - addr % align) % align);
+    }
+
+    [[nodiscard]] inline std::byte* chunk_end() const
+    {
+        return m_chunks[m_current].begin + m_chunks[m_current].size;
+    }
+
+    inline void add_chunk(size_t bytes)
+    {
+        auto buffer = static_cast<std::byte*>(malloc(bytes));
+        if (buffer == nullptr) {
+            compile_error("Out of memory: unable to allocate ", bytes, " bytes for the arena");
+        }
+        m_chunks.push_back({ .begin = buffer, .size = bytes });
+    }
+
+    // Move to a chunk with at least `min_size` bytes, reusing one left over from a
+    // rollback if it is large enough.
+    inline void next_chunk(size_t min_size)
+    {
+        m_waste += chunk_end() - m_offset;
+        size_t size = std::max(m_chunks[m_current].size * 2, min_size);
+        if (m_current + 1 < m_chunks.size() && m_chunks[m_current + 1].size >= min_size) {
+            m_current++;
+        }
+        else {
+            add_chunk(size);
+            Chunk chunk = m_chunks.back();
+            m_chunks.pop_back();
+            m_chunks.insert(m_chunks.begin() + static_cast<ptrdiff_t>(++m_current), chunk);
+        }
+        m_offset = m_chunks[m_current].begin;
+    }
+
+    std::vector<Chunk> m_chunks;
+    size_t m_current = 0;
     std::byte* m_offset;
-};
\ No newline at end of file
+    size_t m_bytes_used = 0;
+    size_t m_waste = 0;
+};
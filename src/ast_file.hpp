@@ -0,0 +1,310 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "./flat_ast.hpp"
+#include "./output.hpp"
+
+// Binary AST file: a FlatAst written out as-is, so a tool can mmap it and use the
+// arrays in place through a FlatAstView, with no parsing and no pointer fix-ups.
+//
+//     header    AstFileHeader
+//     nodes     node_count FlatNodes, 12 bytes each: kind, 3 zero bytes, a, b
+//     lists     list_count uint32s
+//     offsets   string_count + 1 uint32s, string i is [offsets[i], offsets[i + 1])
+//     strings   string_bytes bytes of string data
+//
+// Every section starts at a multiple of 8 from the start of the file, and all
+// integers are little endian. NodeKind values are part of the format, so adding
+// a kind or changing what a node's fields mean bumps ast_file_version.
+
+static_assert(std::endian::native == std::endian::little, "binary AST files are used in place, which needs a little-endian host");
+static_assert(offsetof(FlatNode, kind) == 0 && offsetof(FlatNode, a) == 4 && offsetof(FlatNode, b) == 8);
+
+inline constexpr char ast_file_magic[8] = { 'D', 'U', 'M', 'A', 'S', 'T', '\0', '\0' };
+inline constexpr uint32_t ast_file_version = 3;
+
+struct AstFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t root;
+    uint64_t node_count;
+    uint64_t list_count;
+    uint64_t string_count;
+    uint64_t string_bytes;
+    uint64_t nodes_offset;
+    uint64_t lists_offset;
+    uint64_t offsets_offset;
+    uint64_t strings_offset;
+};
+
+static_assert(sizeof(AstFileHeader) == 80);
+
+// whether `bytes` starts like a binary AST file rather than source text
+inline bool is_ast_file(std::string_view bytes)
+{
+    return bytes.size() >= sizeof(ast_file_magic) && std::memcmp(bytes.data(), ast_file_magic, sizeof(ast_file_magic)) == 0;
+}
+
+inline void write_ast_file(FlatAstView ast, OutputSink& out)
+{
+    auto align = [](uint64_t offset) {
+        return (offset + 7) & ~uint64_t(7);
+    };
+    AstFileHeader header {};
+    std::memcpy(header.magic, ast_file_magic, sizeof(header.magic));
+    header.version = ast_file_version;
+    header.root = ast.root;
+    header.node_count = ast.nodes.size();
+    header.list_count = ast.lists.size();
+    header.string_count = ast.string_offsets.size() - 1;
+    header.string_bytes = ast.string_data.size();
+    header.nodes_offset = align(sizeof(AstFileHeader));
+    header.lists_offset = align(header.nodes_offset + header.node_count * sizeof(FlatNode));
+    header.offsets_offset = align(header.lists_offset + header.list_count * sizeof(uint32_t));
+    header.strings_offset = align(header.offsets_offset + ast.string_offsets.size() * sizeof(uint32_t));
+
+    uint64_t written = 0;
+    auto put = [&](const void* data, size_t size) {
+        out << std::string_view(static_cast<const char*>(data), size);
+        written += size;
+    };
+    auto pad_to = [&](uint64_t offset) {
+        static constexpr char zeros[8] {};
+        put(zeros, offset - written);
+    };
+    put(&header, sizeof(header));
+    pad_to(header.nodes_offset);
+    for (const FlatNode& node : ast.nodes) {
+        // field by field, so the padding after `kind` is always zero
+        char bytes[sizeof(FlatNode)] {};
+        bytes[0] = static_cast<char>(node.kind);
+        std::memcpy(bytes + 4, &node.a, 4);
+        std::memcpy(bytes + 8, &node.b, 4);
+        put(bytes, sizeof(bytes));
+    }
+    pad_to(header.lists_offset);
+    put(ast.lists.data(), ast.lists.size_bytes());
+    pad_to(header.offsets_offset);
+    put(ast.string_offsets.data(), ast.string_offsets.size_bytes());
+    pad_to(header.strings_offset);
+    put(ast.string_data.data(), ast.string_data.size());
+}
+
+// Reads a binary AST file held in memory, normally a mapping of it. The view
+// points into `bytes`, which has to outlive it and be 4-byte aligned.
+//
+// Loading only checks the header and that every section lies inside the file,
+// so it costs the same whatever the file's size. check() also walks every node
+// and makes sure each index it holds is in range, every child comes before its
+// parent and is the kind of node the parent expects there, and functions are
+// only defined at the top level, which is what Generator needs to be safe on an
+// untrusted file.
+class AstFile {
+public:
+    inline explicit AstFile(std::string_view bytes)
+        : m_bytes(bytes)
+    {
+        AstFileHeader header {};
+        if (!is_ast_file(bytes) || bytes.size() < sizeof(header)) {
+            m_error = "not a binary AST file";
+            return;
+        }
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (header.version != ast_file_version) {
+            m_error = "binary AST version " + std::to_string(header.version) + " is not supported (expected "
+                + std::to_string(ast_file_version) + ")";
+            return;
+        }
+        if (reinterpret_cast<uintptr_t>(bytes.data()) % alignof(uint32_t) != 0
+            || !section(header.nodes_offset, header.node_count, sizeof(FlatNode))
+            || !section(header.lists_offset, header.list_count, sizeof(uint32_t))
+            || header.string_count >= UINT32_MAX
+            || !section(header.offsets_offset, header.string_count + 1, sizeof(uint32_t))
+            || !section(header.strings_offset, header.string_bytes, 1)) {
+            m_error = "binary AST file is truncated or corrupt";
+            return;
+        }
+        const char* base = bytes.data();
+        m_view = FlatAstView {
+            .nodes = { reinterpret_cast<const FlatNode*>(base + header.nodes_offset), header.node_count },
+            .lists = { reinterpret_cast<const uint32_t*>(base + header.lists_offset), header.list_count },
+            .string_offsets = { reinterpret_cast<const uint32_t*>(base + header.offsets_offset), header.string_count + 1 },
+            .string_data = { base + header.strings_offset, header.string_bytes },
+            .root = header.root,
+        };
+    }
+
+    [[nodiscard]] inline bool ok() const
+    {
+        return m_view.has_value();
+    }
+
+    // why the file could not be used, once ok() or check() has failed
+    [[nodiscard]] inline const std::string& error() const
+    {
+        return m_error;
+    }
+
+    [[nodiscard]] inline FlatAstView view() const
+    {
+        return m_view.value();
+    }
+
+    inline bool check()
+    {
+        if (!ok()) {
+            return false;
+        }
+        const FlatAstView& ast = m_view.value();
+        const auto string_count = static_cast<uint32_t>(ast.string_offsets.size() - 1);
+        for (uint32_t i = 0; i < string_count; i++) {
+            if (ast.string_offsets[i] > ast.string_offsets[i + 1]) {
+                return fail("string table offsets are out of order");
+            }
+        }
+        if (ast.string_offsets[0] != 0 || ast.string_offsets[string_count] != ast.string_data.size()) {
+            return fail("string table offsets do not cover the string data");
+        }
+        auto child = [&](uint32_t parent, uint32_t index) {
+            return index < parent;
+        };
+        auto expr = [&](uint32_t parent, uint32_t index) {
+            return child(parent, index) && expression(ast.nodes[index].kind);
+        };
+        auto stmt = [&](uint32_t parent, uint32_t index) {
+            return child(parent, index) && statement(ast.nodes[index].kind);
+        };
+        auto scope = [&](uint32_t parent, uint32_t index) {
+            return child(parent, index) && ast.nodes[index].kind == NodeKind::scope;
+        };
+        auto string = [&](uint32_t id) {
+            return id < string_count;
+        };
+        auto list = [&](uint32_t parent, uint32_t first, uint32_t count, auto entry_valid) {
+            if (uint64_t(first) + count > ast.lists.size()) {
+                return false;
+            }
+            for (uint32_t entry : ast.lists.subspan(first, count)) {
+                if (!entry_valid(parent, entry)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto top_level_stmt = [&](uint32_t parent, uint32_t index) {
+            return child(parent, index) && (statement(ast.nodes[index].kind) || ast.nodes[index].kind == NodeKind::function);
+        };
+        for (uint32_t i = 0; i < ast.nodes.size(); i++) {
+            const FlatNode& node = ast.nodes[i];
+            bool valid = false;
+            switch (node.kind) {
+            case NodeKind::int_lit:
+            case NodeKind::ident:
+                valid = string(node.a);
+                break;
+            case NodeKind::paren:
+            case NodeKind::exit:
+            case NodeKind::return_:
+                valid = expr(i, node.a);
+                break;
+            case NodeKind::add:
+            case NodeKind::sub:
+            case NodeKind::multi:
+            case NodeKind::div:
+            case NodeKind::less_than:
+            case NodeKind::greater_than:
+                valid = expr(i, node.a) && expr(i, node.b);
+                break;
+            case NodeKind::let:
+                valid = string(node.a) && expr(i, node.b);
+                break;
+            case NodeKind::scope:
+                valid = list(i, node.a, node.b, stmt);
+                break;
+            case NodeKind::prog:
+                valid = list(i, node.a, node.b, top_level_stmt);
+                break;
+            case NodeKind::if_:
+                valid = expr(i, node.a) && scope(i, node.b);
+                break;
+            case NodeKind::function:
+                valid = string(node.a) && uint64_t(node.b) + 2 <= ast.lists.size() && scope(i, ast.lists[node.b])
+                    && uint64_t(node.b) + 2 + ast.lists[node.b + 1] <= ast.lists.size();
+                if (valid) {
+                    for (uint32_t param : ast.function_params(node)) {
+                        valid = valid && string(param);
+                    }
+                }
+                break;
+            case NodeKind::call:
+                valid = string(node.a) && uint64_t(node.b) + 1 <= ast.lists.size() && list(i, node.b + 1, ast.lists[node.b], expr);
+                break;
+            }
+            if (!valid) {
+                return fail("node " + std::to_string(i) + " is malformed");
+            }
+        }
+        if (ast.root >= ast.nodes.size() || ast.nodes[ast.root].kind != NodeKind::prog) {
+            return fail("the root is not a program node");
+        }
+        return true;
+    }
+
+private:
+    [[nodiscard]] static inline bool expression(NodeKind kind)
+    {
+        switch (kind) {
+        case NodeKind::int_lit:
+        case NodeKind::ident:
+        case NodeKind::paren:
+        case NodeKind::add:
+        case NodeKind::sub:
+        case NodeKind::multi:
+        case NodeKind::div:
+        case NodeKind::less_than:
+        case NodeKind::greater_than:
+        case NodeKind::call:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // a statement that may appear in a scope; definitions also may at the top level
+    [[nodiscard]] static inline bool statement(NodeKind kind)
+    {
+        switch (kind) {
+        case NodeKind::exit:
+        case NodeKind::let:
+        case NodeKind::scope:
+        case NodeKind::if_:
+        case NodeKind::return_:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // whether `count` items of `size` bytes at `offset` fit in the file, aligned
+    [[nodiscard]] inline bool section(uint64_t offset, uint64_t count, uint64_t size) const
+    {
+        return offset % 8 == 0 && offset <= m_bytes.size() && count <= (m_bytes.size() - offset) / size;
+    }
+
+    inline bool fail(std::string error)
+    {
+        m_error = std::move(error);
+        return false;
+    }
+
+    std::string_view m_bytes;
+    std::optional<FlatAstView> m_view;
+    std::string m_error;
+};
\ No newline at end of file
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// 64-bit hash of `bytes`, eight bytes per step. Not cryptographic; it only has to
+// tell different inputs apart.
+inline uint64_t hash_bytes(std::string_view bytes, uint64_t seed = 0)
+{
+    constexpr uint64_t k = 0x9E3779B97F4A7C15;
+    auto mix = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCD;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53;
+        h ^= h >> 33;
+        return h;
+    };
+    uint64_t h = seed ^ (bytes.size() * k);
+    size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, 8);
+        h = (h ^ mix(word)) * k;
+        h = (h << 31) | (h >> 33);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+    return mix(h ^ mix(tail));
+}
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// On-disk cache of compiler outputs. An entry is a directory named after the hex
+// key holding a copy of every artifact a compile produced; the key covers the
+// source, the compiler build and the flags. Entries are published with a rename,
+// so concurrent compiles never see half-written ones. Hits refresh the entry's
+// modification time, and once the cache is over its size limit the least recently
+// used entries are deleted.
+class CompileCache {
+public:
+    static constexpr uint64_t default_max_bytes = 256ull * 1024 * 1024;
+
+    inline CompileCache(std::filesystem::path dir, uint64_t max_bytes = default_max_bytes)
+        : m_dir(std::move(dir))
+        , m_max_bytes(max_bytes)
+    {
+        std::error_code err;
+        std::filesystem::create_directories(m_dir, err);
+        m_ok = std::filesystem::is_directory(m_dir, err);
+    }
+
+    // $XDG_CACHE_HOME/dum, else ~/.cache/dum
+    static std::filesystem::path default_dir()
+    {
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+            return std::filesystem::path(xdg) / "dum";
+        }
+        if (const char* home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+            return std::filesystem::path(home) / ".cache" / "dum";
+        }
+        return std::filesystem::temp_directory_path() / "dum-cache";
+    }
+
+    // `config` is everything besides the source that changes the output: the
+    // compiler build and the flags
+    static uint64_t key(std::string_view source, std::string_view config)
+    {
+        return hash_bytes(source, hash_bytes(config));
+    }
+
+    [[nodiscard]] inline bool ok() const
+    {
+        return m_ok;
+    }
+
+    // Copies the cached artifacts for `key` back to their paths. Counts a hit or
+    // a miss either way.
+    inline bool restore(uint64_t key, std::span<const std::string> artifacts)
+    {
+        std::filesystem::path entry = entry_path(key);
+        std::error_code err;
+        bool hit = std::filesystem::is_directory(entry, err);
+        for (const std::string& artifact : artifacts) {
+            if (!hit) {
+                break;
+            }
+            std::filesystem::path cached = entry / std::filesystem::path(artifact).filename();
+            hit = std::filesystem::copy_file(cached, artifact, std::filesystem::copy_options::overwrite_existing, err);
+        }
+        if (hit) {
+            std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), err);
+        }
+        count(hit);
+        return hit;
+    }
+
+    // Saves the artifacts of a successful compile under `key`, then trims the
+    // cache back under its size limit.
+    inline void store(uint64_t key, std::span<const std::string> artifacts)
+    {
+        std::error_code err;
+        std::filesystem::path tmp = m_dir / ("tmp-" + std::to_string(getpid()) + "-" + hex(key));
+        std::filesystem::create_directory(tmp, err);
+        for (const std::string& artifact : artifacts) {
+            std::filesystem::copy_file(artifact, tmp / std::filesystem::path(artifact).filename(), std::filesystem::copy_options::overwrite_existing, err);
+            if (err) {
+                std::filesystem::remove_all(tmp, err);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, entry_path(key), err);
+        if (err) {
+            // somebody else stored the same entry first
+            std::filesystem::remove_all(tmp, err);
+        }
+        evict();
+    }
+
+    [[nodiscard]] inline CacheStats stats() const
+    {
+        CacheStats stats = read_counters();
+        for (const Entry& entry : entries()) {
+            stats.entries++;
+            stats.bytes += entry.bytes;
+        }
+        return stats;
+    }
+
+    // deletes least recently used entries until the cache fits its size limit
+    inline void evict()
+    {
+        std::vector<Entry> all = entries();
+        uint64_t total = 0;
+        for (const Entry& entry : all) {
+            total += entry.bytes;
+        }
+        if (total <= m_max_bytes) {
+            return;
+        }
+        std::sort(all.begin(), all.end(), [](const Entry& a, const Entry& b) {
+            return a.used < b.used;
+        });
+        std::error_code err;
+        for (const Entry& entry : all) {
+            if (total <= m_max_bytes) {
+                break;
+            }
+            std::filesystem::remove_all(entry.path, err);
+            total -= entry.bytes;
+        }
+    }
+
+private:
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uint64_t bytes;
+    };
+
+    static std::string hex(uint64_t key)
+    {
+        char buf[17];
+        std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(key));
+        return buf;
+    }
+
+    [[nodiscard]] inline std::filesystem::path entry_path(uint64_t key) const
+    {
+        return m_dir / hex(key);
+    }
+
+    [[nodiscard]] inline std::vector<Entry> entries() const
+    {
+        std::vector<Entry> all;
+        std::error_code err;
+        for (const auto& dir : std::filesystem::directory_iterator(m_dir, err)) {
+            std::string name = dir.path().filename().string();
+            if (!dir.is_directory(err) || name.size() != 16) {
+                continue;
+            }
+            Entry entry { .path = dir.path(), .used = dir.last_write_time(err), .bytes = 0 };
+            for (const auto& file : std::filesystem::directory_iterator(dir.path(), err)) {
+                entry.bytes += file.file_size(err);
+            }
+            all.push_back(entry);
+        }
+        return all;
+    }
+
+    // hit and miss counters live in `stats`, updated under a file lock so
+    // concurrent compiles don't lose counts
+    inline void count(bool hit)
+    {
+        int fd = ::open((m_dir / "stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return;
+        }
+        flock(fd, LOCK_EX);
+        CacheStats stats = parse_counters(fd);
+        (hit ? stats.hits : stats.misses)++;
+        std::string text = std::to_string(stats.hits) + " " + std::to_string(stats.misses) + "\n";
+        if (ftruncate(fd, 0) == 0) {
+            pwrite(fd, text.data(), text.size(), 0);
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    [[nodiscard]] inline CacheStats read_counters() const
+    {
+        int fd = ::open((m_dir / "stats").c_str(), O_RDONLY);
+        if (fd < 0) {
+            return {};
+        }
+        flock(fd, LOCK_SH);
+        CacheStats stats = parse_counters(fd);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return stats;
+    }
+
+    static CacheStats parse_counters(int fd)
+    {
+        char buf[64] {};
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        CacheStats stats;
+        if (n > 0) {
+            unsigned long long hits = 0;
+            unsigned long long misses = 0;
+            if (std::sscanf(buf, "%llu %llu", &hits, &misses) == 2) {
+                stats.hits = hits;
+                stats.misses = misses;
+            }
+        }
+        return stats;
+    }
+
+    std::filesystem::path m_dir;
+    uint64_t m_max_bytes;
+    bool m_ok = false;
+};
\ No newline at end of file
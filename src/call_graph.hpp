@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "./flat_ast.hpp"
+
+// Which top-level functions a whole program defines and who calls them, and from
+// that which calls Generator should expand in place. A function is inlined at
+// every call when its body, counting the bodies inlined into it, is at most
+// `inline_limit` nodes, or when it is called from only one place, so inlining it
+// adds no code once the out-of-line copy is left out. Functions that can reach
+// themselves through calls are never inlined.
+class CallGraph {
+public:
+    inline CallGraph(FlatAstView ast, size_t inline_limit)
+        : m_ast(ast)
+    {
+        for (uint32_t stmt : ast.stmts(ast.node(ast.root))) {
+            const FlatNode& node = ast.node(stmt);
+            if (node.kind == NodeKind::function && !m_index.contains(node.a)) {
+                m_index.emplace(node.a, static_cast<uint32_t>(m_functions.size()));
+                m_functions.push_back({ .node = stmt });
+            }
+        }
+        for (uint32_t stmt : ast.stmts(ast.node(ast.root))) {
+            if (ast.node(stmt).kind != NodeKind::function) {
+                walk(stmt, nullptr);
+            }
+        }
+        for (Function& function : m_functions) {
+            walk(ast.function_scope(ast.node(function.node)), &function);
+        }
+        decide(inline_limit);
+    }
+
+    // the function node defining `name`
+    [[nodiscard]] inline std::optional<uint32_t> definition(uint32_t name) const
+    {
+        auto it = m_index.find(name);
+        if (it == m_index.end()) {
+            return {};
+        }
+        return m_functions[it->second].node;
+    }
+
+    [[nodiscard]] inline bool inline_calls_to(uint32_t name) const
+    {
+        auto it = m_index.find(name);
+        return it != m_index.end() && m_functions[it->second].inline_;
+    }
+
+    // Whether calling `name` runs a real call instruction, either its own or one
+    // left in a body inlined into it. False for unknown names.
+    [[nodiscard]] inline bool makes_calls(uint32_t name) const
+    {
+        auto it = m_index.find(name);
+        return it != m_index.end() && m_functions[it->second].makes_calls;
+    }
+
+private:
+    struct Function {
+        uint32_t node;
+        uint64_t size = 0; // nodes in the body
+        uint64_t call_sites = 0; // calls to it anywhere in the program
+        std::vector<uint32_t> callees {}; // index of the callee of each call in the body that has a definition
+        bool calls_unknown = false; // calls something with no definition
+        uint64_t inlined_size = 0; // size with the callees that get inlined expanded
+        bool inline_ = false;
+        bool makes_calls = false;
+    };
+
+    // Counts the nodes under `index` into `function`, if there is one, and records
+    // the calls they make. Nested definitions are not part of the body.
+    void walk(uint32_t index, Function* function)
+    {
+        const FlatNode& node = m_ast.node(index);
+        if (node.kind == NodeKind::function) {
+            return;
+        }
+        if (function != nullptr) {
+            function->size++;
+        }
+        switch (node.kind) {
+        case NodeKind::int_lit:
+        case NodeKind::ident:
+            break;
+        case NodeKind::paren:
+        case NodeKind::exit:
+        case NodeKind::return_:
+            walk(node.a, function);
+            break;
+        case NodeKind::let:
+            walk(node.b, function);
+            break;
+        case NodeKind::scope:
+        case NodeKind::prog:
+            for (uint32_t stmt : m_ast.stmts(node)) {
+                walk(stmt, function);
+            }
+            break;
+        case NodeKind::call: {
+            for (uint32_t arg : m_ast.call_args(node)) {
+                walk(arg, function);
+            }
+            auto it = m_index.find(node.a);
+            if (it == m_index.end()) {
+                if (function != nullptr) {
+                    function->calls_unknown = true;
+                }
+                break;
+            }
+            m_functions[it->second].call_sites++;
+            if (function != nullptr) {
+                function->callees.push_back(it->second);
+            }
+            break;
+        }
+        default:
+            // binary expressions and if
+            walk(node.a, function);
+            walk(node.b, function);
+        }
+    }
+
+    // Tarjan's strongly connected components, without recursion so a long chain
+    // of calls can't run out of stack. Components come out callees first, so
+    // every function is decided after everything it calls outside its component.
+    void decide(size_t inline_limit)
+    {
+        constexpr uint32_t unvisited = UINT32_MAX;
+        std::vector<uint32_t> order(m_functions.size(), unvisited);
+        std::vector<uint32_t> low(m_functions.size());
+        std::vector<bool> on_stack(m_functions.size());
+        std::vector<uint32_t> stack;
+        std::vector<std::pair<uint32_t, size_t>> path; // function, next callee to visit
+        uint32_t counter = 0;
+        auto visit = [&](uint32_t f) {
+            order[f] = low[f] = counter++;
+            stack.push_back(f);
+            on_stack[f] = true;
+            path.emplace_back(f, 0);
+        };
+        for (uint32_t root = 0; root < m_functions.size(); root++) {
+            if (order[root] != unvisited) {
+                continue;
+            }
+            visit(root);
+            while (!path.empty()) {
+                uint32_t f = path.back().first;
+                size_t& next = path.back().second;
+                if (next < m_functions[f].callees.size()) {
+                    uint32_t callee = m_functions[f].callees[next++];
+                    if (order[callee] == unvisited) {
+                        visit(callee);
+                    }
+                    else if (on_stack[callee]) {
+                        low[f] = std::min(low[f], order[callee]);
+                    }
+                    continue;
+                }
+                path.pop_back();
+                if (!path.empty()) {
+                    low[path.back().first] = std::min(low[path.back().first], low[f]);
+                }
+                if (low[f] != order[f]) {
+                    continue;
+                }
+                auto first = std::find(stack.begin(), stack.end(), f);
+                std::vector<uint32_t> component(first, stack.end());
+                stack.erase(first, stack.end());
+                for (uint32_t member : component) {
+                    on_stack[member] = false;
+                }
+                decide_component(component, inline_limit);
+            }
+        }
+    }
+
+    void decide_component(const std::vector<uint32_t>& component, size_t inline_limit)
+    {
+        const std::vector<uint32_t>& callees = m_functions[component.front()].callees;
+        bool recursive = component.size() > 1
+            || std::find(callees.begin(), callees.end(), component.front()) != callees.end();
+        for (uint32_t member : component) {
+            Function& function = m_functions[member];
+            function.inlined_size = function.size;
+            function.makes_calls = function.calls_unknown || recursive;
+            for (uint32_t callee : function.callees) {
+                const Function& target = m_functions[callee];
+                if (recursive || !target.inline_) {
+                    function.makes_calls = true;
+                    continue;
+                }
+                function.inlined_size = std::min<uint64_t>(function.inlined_size + target.inlined_size, UINT32_MAX);
+                function.makes_calls = function.makes_calls || target.makes_calls;
+            }
+            function.inline_ = !recursive && (function.inlined_size <= inline_limit || function.call_sites == 1);
+        }
+    }
+
+    FlatAstView m_ast;
+    std::vector<Function> m_functions; // in definition order
+    std::unordered_map<uint32_t, uint32_t> m_index; // string id of a name -> its entry in m_functions
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DUM_SCAN_X86 1
+#endif
+
+// Character classes the tokenizer cares about, for ASCII only: unlike
+// std::isalpha and friends they don't depend on the locale, and bytes above 0x7f
+// are in none of them.
+namespace char_class {
+
+enum : uint8_t {
+    space = 1 << 0,
+    alpha = 1 << 1,
+    digit = 1 << 2,
+};
+
+inline constexpr std::array<uint8_t, 256> table = [] {
+    std::array<uint8_t, 256> classes {};
+    for (char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+        classes[static_cast<uint8_t>(c)] = space;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        classes[c] = alpha;
+        classes[c - 'a' + 'A'] = alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        classes[c] = digit;
+    }
+    return classes;
+}();
+
+inline constexpr bool is(char c, uint8_t classes)
+{
+    return (table[static_cast<uint8_t>(c)] & classes) != 0;
+}
+
+} // namespace char_class
+
+// Finds the end of a run of whitespace, identifier characters or digits: each
+// function returns the first position at or after `begin` whose byte is outside
+// the class, or `end`. The x86 versions look at 16 (SSE2) or 32 (AVX2) bytes per
+// step and fall back to the table for the last few bytes of the input, so they
+// never read past `end`.
+struct CharScanner {
+    const char* (*space)(const char* begin, const char* end);
+    const char* (*alnum)(const char* begin, const char* end);
+    const char* (*digits)(const char* begin, const char* end);
+    const char* name;
+
+    static inline const CharScanner& scalar();
+#ifdef DUM_SCAN_X86
+    static inline const CharScanner& sse2();
+    static inline const CharScanner& avx2();
+#endif
+    // the widest version this CPU supports, picked once
+    static inline const CharScanner& best();
+};
+
+namespace char_scan {
+
+inline constexpr uint8_t alnum = char_class::alpha | char_class::digit;
+
+template <uint8_t Classes>
+inline const char* scalar_run(const char* begin, const char* end)
+{
+    while (begin != end && char_class::is(*begin, Classes)) {
+        begin++;
+    }
+    return begin;
+}
+
+#ifdef DUM_SCAN_X86
+
+// Each mask has a bit set for every byte in the class. Bytes above 0x7f are
+// negative as signed bytes, so the signed range checks leave them out.
+inline __m128i digit_mask(__m128i bytes)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+}
+
+inline __m128i alpha_mask(__m128i bytes)
+{
+    __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    return _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+}
+
+inline __m128i space_mask(__m128i bytes)
+{
+    __m128i control = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1)));
+    return _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+}
+
+template <uint8_t Classes>
+inline __m128i class_mask(__m128i bytes)
+{
+    if constexpr (Classes == char_class::space) {
+        return space_mask(bytes);
+    }
+    else if constexpr (Classes == char_class::digit) {
+        return digit_mask(bytes);
+    }
+    else {
+        return _mm_or_si128(alpha_mask(bytes), digit_mask(bytes));
+    }
+}
+
+template <uint8_t Classes>
+inline const char* sse2_run(const char* begin, const char* end)
+{
+    while (end - begin >= 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        uint32_t outside = ~static_cast<uint32_t>(_mm_movemask_epi8(class_mask<Classes>(bytes))) & 0xffff;
+        if (outside != 0) {
+            return begin + std::countr_zero(outside);
+        }
+        begin += 16;
+    }
+    return scalar_run<Classes>(begin, end);
+}
+
+__attribute__((target("avx2"))) inline __m256i digit_mask(__m256i bytes)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+}
+
+__attribute__((target("avx2"))) inline __m256i alpha_mask(__m256i bytes)
+{
+    __m256i lower = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+    return _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+}
+
+__attribute__((target("avx2"))) inline __m256i space_mask(__m256i bytes)
+{
+    __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), bytes));
+    return _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+}
+
+template <uint8_t Classes>
+__attribute__((target("avx2"))) inline const char* avx2_run(const char* begin, const char* end)
+{
+    while (end - begin >= 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        __m256i mask;
+        if constexpr (Classes == char_class::space) {
+            mask = space_mask(bytes);
+        }
+        else if constexpr (Classes == char_class::digit) {
+            mask = digit_mask(bytes);
+        }
+        else {
+            mask = _mm256_or_si256(alpha_mask(bytes), digit_mask(bytes));
+        }
+        uint32_t outside = ~static_cast<uint32_t>(_mm256_movemask_epi8(mask));
+        if (outside != 0) {
+            return begin + std::countr_zero(outside);
+        }
+        begin += 32;
+    }
+    return sse2_run<Classes>(begin, end);
+}
+
+#endif
+
+} // namespace char_scan
+
+inline const CharScanner& CharScanner::scalar()
+{
+    static const CharScanner scanner {
+        .space = char_scan::scalar_run<char_class::space>,
+        .alnum = char_scan::scalar_run<char_scan::alnum>,
+        .digits = char_scan::scalar_run<char_class::digit>,
+        .name = "scalar",
+    };
+    return scanner;
+}
+
+#ifdef DUM_SCAN_X86
+
+inline const CharScanner& CharScanner::sse2()
+{
+    static const CharScanner scanner {
+        .space = char_scan::sse2_run<char_class::space>,
+        .alnum = char_scan::sse2_run<char_scan::alnum>,
+        .digits = char_scan::sse2_run<char_class::digit>,
+        .name = "sse2",
+    };
+    return scanner;
+}
+
+inline const CharScanner& CharScanner::avx2()
+{
+    static const CharScanner scanner {
+        .space = char_scan::avx2_run<char_class::space>,
+        .alnum = char_scan::avx2_run<char_scan::alnum>,
+        .digits = char_scan::avx2_run<char_class::digit>,
+        .name = "avx2",
+    };
+    return scanner;
+}
+
+#endif
+
+inline const CharScanner& CharScanner::best()
+{
+#ifdef DUM_SCAN_X86
+    static const CharScanner& scanner = __builtin_cpu_supports("avx2") ? avx2() : sse2();
+    return scanner;
+#else
+    return scalar();
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// An error in the program being compiled. The phases throw it rather than exit,
+// so one bad input only fails its own compile, and a batch carries on with the
+// rest.
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// throws a CompileError with `parts` streamed together as its message
+template <typename... Parts>
+[[noreturn]] inline void compile_error(const Parts&... parts)
+{
+    std::ostringstream message;
+    (message << ... << parts);
+    throw CompileError(message.str());
+}
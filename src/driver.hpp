@@ -0,0 +1,317 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./ast_file.hpp"
+#include "./compile_error.hpp"
+#include "./elf.hpp"
+#include "./encoder.hpp"
+#include "./generation.hpp"
+#include "./optimizer.hpp"
+#include "./source.hpp"
+#include "./thread_pool.hpp"
+
+// Everything besides the input that decides what a compile produces.
+struct CompileOptions {
+    bool optimize = true;
+    // compile each top-level statement as soon as it is parsed
+    bool stream = false;
+    // write the assembly through a mapping of the file instead of buffered writes
+    bool mmap_output = false;
+    GeneratorOptions generator {};
+};
+
+struct CompileResult {
+    bool ok = true;
+    std::string error {}; // set when !ok
+    PeepholeStats peephole_stats {};
+};
+
+inline std::unique_ptr<OutputSink> open_asm_file(const std::string& path, const CompileOptions& options)
+{
+    if (options.mmap_output) {
+        return std::make_unique<MappedFileSink>(path);
+    }
+    return std::make_unique<FileSink>(path);
+}
+
+// Finishes the assembly and, with `machine_code`, writes the executable. Returns
+// false and fills in `result` if either could not be written.
+inline bool write_outputs(
+    OutputSink& asm_file, const std::string& asm_path, Encoder* machine_code, const std::string& exe_path,
+    Profiler* profiler, CompileResult& result)
+{
+    {
+        ProfileScope scope(profiler, "write assembly");
+        if (!asm_file.finish()) {
+            result = { .ok = false, .error = "Unable to write `" + asm_path + "`." };
+            return false;
+        }
+    }
+    if (machine_code != nullptr) {
+        ProfileScope scope(profiler, "write executable");
+        std::vector<uint8_t> code = machine_code->finish();
+        if (profiler != nullptr) {
+            profiler->count("machine code bytes", code.size());
+        }
+        if (!write_elf(exe_path, code)) {
+            result = { .ok = false, .error = "Unable to write executable `" + exe_path + "`." };
+            return false;
+        }
+    }
+    if (profiler != nullptr) {
+        profiler->count("asm bytes", asm_file.size());
+    }
+    return true;
+}
+
+// The result of a compile that stopped at an error, in the program or in the
+// compiler itself. The assembly written so far is removed rather than left half done.
+inline CompileResult discard_outputs(std::unique_ptr<OutputSink>& asm_file, const std::string& asm_path, std::string error)
+{
+    asm_file.reset();
+    std::error_code err;
+    std::filesystem::remove(asm_path, err);
+    return { .ok = false, .error = std::move(error) };
+}
+
+// message for an exception that is not a CompileError, which means a bug in dum
+inline std::string internal_error(const std::exception& error)
+{
+    return std::string("Internal compiler error: ") + error.what();
+}
+
+inline CompileResult compile_source_into(
+    std::string_view source, OutputSink& asm_file, const std::string& asm_path, const std::string& exe_path,
+    const CompileOptions& options, ArenaAllocator& arena, Profiler* profiler)
+{
+    arena.reset();
+    Interner symbols;
+    Tokenizer tokenizer(source, symbols);
+    // the parser pulls tokens from the tokenizer as it goes
+    Parser parser(tokenizer, arena);
+    parser.set_profiler(profiler);
+
+    Encoder encoder;
+    Encoder* machine_code = exe_path.empty() ? nullptr : &encoder;
+
+    CompileResult result;
+    ConstFolder folder(arena);
+    size_t node_count = 0;
+    size_t arena_peak = 0;
+    if (options.stream) {
+        // each top-level statement is compiled and written out as soon as it is parsed,
+        // and the arena is rewound for the next one
+        FlatAst ast;
+        Flattener flattener(ast);
+        Generator generator(options.generator);
+        generator.set_profiler(profiler);
+        ArenaAllocator::Mark start = arena.mark();
+        generator.begin_prog(asm_file, machine_code);
+        while (true) {
+            std::optional<NodeStmt*> stmt;
+            {
+                ProfileScope scope(profiler, "parse");
+                stmt = parser.parse_top_level();
+            }
+            if (!stmt.has_value()) {
+                break;
+            }
+            bool keep = true;
+            if (options.optimize) {
+                ProfileScope scope(profiler, "fold");
+                keep = folder.fold_top_level(stmt.value());
+            }
+            if (keep) {
+                {
+                    ProfileScope scope(profiler, "flatten");
+                    flattener.flatten_top_level(stmt.value());
+                }
+                node_count += ast.nodes.size();
+                ProfileScope scope(profiler, "generate");
+                generator.gen_top_level(ast.view());
+            }
+            arena_peak = std::max(arena_peak, arena.stats().bytes_used);
+            arena.rollback(start);
+        }
+        ProfileScope scope(profiler, "generate");
+        generator.end_prog();
+        result.peephole_stats = generator.peephole_stats();
+    }
+    else {
+        std::optional<NodeProg> prog;
+        {
+            ProfileScope scope(profiler, "parse");
+            prog = parser.parse_prog();
+        }
+        if (!prog.has_value()) {
+            compile_error("Parser error");
+        }
+        if (options.optimize) {
+            ProfileScope scope(profiler, "fold");
+            folder.fold_prog(prog.value());
+        }
+        arena_peak = arena.stats().bytes_used;
+        FlatAst ast;
+        {
+            ProfileScope scope(profiler, "flatten");
+            ast = flatten(prog.value());
+        }
+        node_count = ast.nodes.size();
+        ProfileScope scope(profiler, "generate");
+        Generator generator(ast.view(), options.generator);
+        generator.set_profiler(profiler);
+        generator.gen_prog(asm_file, machine_code);
+        result.peephole_stats = generator.peephole_stats();
+    }
+    if (!write_outputs(asm_file, asm_path, machine_code, exe_path, profiler, result)) {
+        return result;
+    }
+    if (profiler != nullptr) {
+        ArenaStats stats = arena.stats();
+        profiler->count("source bytes", source.size());
+        profiler->count("tokens", parser.token_count());
+        profiler->count("ast nodes", node_count);
+        profiler->high_water("arena bytes used", arena_peak);
+        profiler->high_water("arena bytes reserved", stats.bytes_reserved);
+        profiler->high_water("arena chunks", stats.chunks);
+    }
+    return result;
+}
+
+// Compiles `source` into NASM at `asm_path` and, unless `exe_path` is empty, into a
+// static executable at `exe_path` using the built-in assembler. The tree is built
+// in `arena`, which is reset first. Errors in the program itself are returned like
+// output failures are, and leave no assembly behind. With a `profiler`, every phase
+// is timed and the sizes of what they produced are counted.
+inline CompileResult compile_source(
+    std::string_view source, const std::string& asm_path, const std::string& exe_path,
+    const CompileOptions& options, ArenaAllocator& arena, Profiler* profiler = nullptr)
+{
+    std::unique_ptr<OutputSink> asm_file = open_asm_file(asm_path, options);
+    try {
+        return compile_source_into(source, *asm_file, asm_path, exe_path, options, arena, profiler);
+    }
+    catch (const CompileError& error) {
+        return discard_outputs(asm_file, asm_path, error.what());
+    }
+    catch (const std::exception& error) {
+        return discard_outputs(asm_file, asm_path, internal_error(error));
+    }
+}
+
+inline CompileResult compile_ast_into(
+    FlatAstView ast, OutputSink& asm_file, const std::string& asm_path, const std::string& exe_path,
+    const CompileOptions& options, Profiler* profiler)
+{
+    Encoder encoder;
+    Encoder* machine_code = exe_path.empty() ? nullptr : &encoder;
+
+    CompileResult result;
+    {
+        ProfileScope scope(profiler, "generate");
+        Generator generator(ast, options.generator);
+        generator.set_profiler(profiler);
+        generator.gen_prog(asm_file, machine_code);
+        result.peephole_stats = generator.peephole_stats();
+    }
+    if (!write_outputs(asm_file, asm_path, machine_code, exe_path, profiler, result)) {
+        return result;
+    }
+    if (profiler != nullptr) {
+        profiler->count("ast nodes", ast.nodes.size());
+    }
+    return result;
+}
+
+// Same as compile_source, starting from a tree that is already flattened, such as
+// one loaded from a binary AST file. Constant folding works on the parser's tree,
+// so it is skipped here; files written by -bast are already folded unless -O0.
+inline CompileResult compile_ast(
+    FlatAstView ast, const std::string& asm_path, const std::string& exe_path,
+    const CompileOptions& options, Profiler* profiler = nullptr)
+{
+    std::unique_ptr<OutputSink> asm_file = open_asm_file(asm_path, options);
+    try {
+        return compile_ast_into(ast, *asm_file, asm_path, exe_path, options, profiler);
+    }
+    catch (const CompileError& error) {
+        return discard_outputs(asm_file, asm_path, error.what());
+    }
+    catch (const std::exception& error) {
+        return discard_outputs(asm_file, asm_path, internal_error(error));
+    }
+}
+
+struct CompileJob {
+    std::string input; // source path, or `-` for stdin
+    std::string asm_path;
+    std::string exe_path {}; // empty to stop at assembly
+};
+
+// Output paths for `input`: its name without the extension, plus `.asm` for the
+// assembly, next to the input or in `out_dir` if one is given.
+inline CompileJob job_for(const std::string& input, const std::string& out_dir, bool link)
+{
+    std::filesystem::path path(input);
+    std::filesystem::path base = out_dir.empty() ? path.parent_path() / path.stem() : std::filesystem::path(out_dir) / path.stem();
+    CompileJob job { .input = input, .asm_path = base.string() + ".asm" };
+    if (link) {
+        job.exe_path = base.string();
+    }
+    return job;
+}
+
+// Compiles every job on `threads` threads (0 for one per core), each with an arena
+// of its own that is reused from one input to the next. Failures are reported as
+// they happen; returns how many jobs failed.
+inline size_t compile_batch(const std::vector<CompileJob>& jobs, const CompileOptions& options, size_t threads = 0)
+{
+    WorkStealingPool pool(threads);
+    std::vector<std::unique_ptr<ArenaAllocator>> arenas;
+    for (size_t i = 0; i < pool.threads(); i++) {
+        arenas.push_back(std::make_unique<ArenaAllocator>(1024 * 1024 * 4));
+    }
+    std::atomic<size_t> failed = 0;
+    std::mutex report;
+    pool.run(jobs.size(), [&](size_t worker, size_t index) {
+        const CompileJob& job = jobs[index];
+        CompileResult result;
+        // an exception must not reach the pool, which would take every other job with it
+        try {
+            SourceFile source(job.input);
+            if (!source.ok()) {
+                result = { .ok = false, .error = "File not found: `" + job.input + "`." };
+            }
+            else if (is_ast_file(source.view())) {
+                AstFile ast_file(source.view());
+                if (ast_file.check()) {
+                    result = compile_ast(ast_file.view(), job.asm_path, job.exe_path, options);
+                }
+                else {
+                    result = { .ok = false, .error = "Unable to load `" + job.input + "`: " + ast_file.error() + "." };
+                }
+            }
+            else {
+                result = compile_source(source.view(), job.asm_path, job.exe_path, options, *arenas[worker]);
+            }
+        }
+        catch (const std::exception& error) {
+            result = { .ok = false, .error = job.input + ": " + internal_error(error) };
+        }
+        if (!result.ok) {
+            failed++;
+            std::lock_guard guard(report);
+            std::cerr << result.error << std::endl;
+        }
+    });
+    return failed;
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Writes `code` as a static ELF64 executable: one read+execute PT_LOAD segment
+// mapping the headers and the code, with the entry point at the first code byte.
+// Returns false if the file could not be written.
+inline bool write_elf(const std::string& path, const std::vector<uint8_t>& code)
+{
+    constexpr uint64_t base = 0x400000;
+    constexpr uint16_t ehdr_size = 64;
+    constexpr uint16_t phdr_size = 56;
+    constexpr uint64_t code_offset = ehdr_size + phdr_size;
+
+    std::vector<uint8_t> image(code_offset);
+    auto put = [&](size_t offset, uint64_t value, int size) {
+        for (int i = 0; i < size; i++) {
+            image[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    };
+
+    // ELF header
+    std::memcpy(image.data(), "\x7f" "ELF", 4);
+    image[4] = 2; // ELFCLASS64
+    image[5] = 1; // little endian
+    image[6] = 1; // EV_CURRENT
+    put(16, 2, 2); // ET_EXEC
+    put(18, 62, 2); // EM_X86_64
+    put(20, 1, 4); // EV_CURRENT
+    put(24, base + code_offset, 8); // e_entry
+    put(32, ehdr_size, 8); // e_phoff
+    put(40, 0, 8); // e_shoff: no section headers
+    put(48, 0, 4); // e_flags
+    put(52, ehdr_size, 2);
+    put(54, phdr_size, 2);
+    put(56, 1, 2); // e_phnum
+    put(58, 64, 2); // e_shentsize
+    put(60, 0, 2); // e_shnum
+    put(62, 0, 2); // e_shstrndx
+
+    // program header
+    uint64_t file_size = code_offset + code.size();
+    put(ehdr_size + 0, 1, 4); // PT_LOAD
+    put(ehdr_size + 4, 5, 4); // PF_R | PF_X
+    put(ehdr_size + 8, 0, 8); // p_offset
+    put(ehdr_size + 16, base, 8); // p_vaddr
+    put(ehdr_size + 24, base, 8); // p_paddr
+    put(ehdr_size + 32, file_size, 8); // p_filesz
+    put(ehdr_size + 40, file_size, 8); // p_memsz
+    put(ehdr_size + 48, 0x1000, 8); // p_align
+
+    image.insert(image.end(), code.begin(), code.end());
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < image.size()) {
+        ssize_t n = write(fd, image.data() + written, image.size() - written);
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+    // O_CREAT only applies the mode to new files
+    fchmod(fd, 0755);
+    return close(fd) == 0;
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "./compile_error.hpp"
+#include "./instructions.hpp"
+
+// Encodes instruction lists into x86-64 machine code. Only the forms Generator
+// produces are supported; anything else is reported and aborts the compile. Jumps
+// and calls always use 32-bit displacements, patched once every label has an
+// address, so code can be fed in pieces as it is generated.
+class Encoder {
+public:
+    // appends the code for `instrs`
+    inline void encode(std::span<const Instr> instrs)
+    {
+        for (const Instr& instr : instrs) {
+            encode_instr(instr);
+        }
+    }
+
+    // resolves jumps and hands over the finished code
+    inline std::vector<uint8_t> finish()
+    {
+        for (const Fixup& fixup : m_fixups) {
+            if (fixup.label >= m_labels.size() || !m_labels[fixup.label].has_value()) {
+                compile_error("Jump to undefined label ", fixup.label);
+            }
+            auto rel = static_cast<int32_t>(static_cast<int64_t>(m_labels[fixup.label].value()) - static_cast<int64_t>(fixup.offset + 4));
+            for (int i = 0; i < 4; i++) {
+                m_code[fixup.offset + i] = static_cast<uint8_t>(static_cast<uint32_t>(rel) >> (8 * i));
+            }
+        }
+        return std::move(m_code);
+    }
+
+private:
+    struct Fixup {
+        size_t offset; // of the rel32 field
+        size_t label;
+    };
+
+    static bool fits_i8(int64_t value)
+    {
+        return value >= std::numeric_limits<int8_t>::min() && value <= std::numeric_limits<int8_t>::max();
+    }
+
+    static bool fits_i32(int64_t value)
+    {
+        return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+    }
+
+    static int num(Reg reg)
+    {
+        return static_cast<int>(reg);
+    }
+
+    void byte(uint64_t value)
+    {
+        m_code.push_back(static_cast<uint8_t>(value));
+    }
+
+    void bytes(uint64_t value, int count)
+    {
+        for (int i = 0; i < count; i++) {
+            byte(value >> (8 * i));
+        }
+    }
+
+    // REX prefix for `reg` in ModRM.reg and `rm` in ModRM.rm (or a memory base),
+    // left out when it would be empty
+    void rex(bool wide, int reg, const Operand& rm)
+    {
+        bool index_high = rm.kind == Operand::Kind::mem && rm.scale != 0 && (num(rm.index) & 8);
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | (index_high ? 2 : 0) | ((num(rm.reg) & 8) ? 1 : 0);
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    // ModRM (plus SIB and displacement) addressing `rm` with `reg` in the reg field
+    void modrm(int reg, const Operand& rm)
+    {
+        int base = num(rm.reg) & 7;
+        if (rm.kind == Operand::Kind::reg) {
+            byte(0xC0 | ((reg & 7) << 3) | base);
+            return;
+        }
+        if (rm.kind != Operand::Kind::mem || !fits_i32(rm.value)) {
+            unsupported();
+        }
+        // [rbp] and [r13] have no displacement-free form
+        int mod = rm.value == 0 && base != 5 ? 0 : fits_i8(rm.value) ? 1 : 2;
+        if (rm.scale != 0) {
+            // rsp can't be an index: its encoding means no index
+            if (rm.index == Reg::rsp || !std::has_single_bit(rm.scale) || rm.scale > 8) {
+                unsupported();
+            }
+            byte((mod << 6) | ((reg & 7) << 3) | 4);
+            byte((std::countr_zero(rm.scale) << 6) | ((num(rm.index) & 7) << 3) | base);
+        }
+        else {
+            byte((mod << 6) | ((reg & 7) << 3) | base);
+            if (base == 4) {
+                byte(0x24); // SIB for rsp/r12 as base, no index
+            }
+        }
+        if (mod == 1) {
+            byte(rm.value);
+        }
+        else if (mod == 2) {
+            bytes(rm.value, 4);
+        }
+    }
+
+    // op r/m64, r64
+    void rm_reg(uint8_t opcode, const Operand& rm, const Operand& reg)
+    {
+        if (reg.kind != Operand::Kind::reg) {
+            unsupported();
+        }
+        rex(true, num(reg.reg), rm);
+        byte(opcode);
+        modrm(num(reg.reg), rm);
+    }
+
+    // op r/m64 with an opcode extension in ModRM.reg
+    void rm_ext(std::initializer_list<uint8_t> opcode, int ext, const Operand& rm)
+    {
+        rex(true, 0, rm);
+        for (uint8_t op : opcode) {
+            byte(op);
+        }
+        modrm(ext, rm);
+    }
+
+    // add/sub/xor/... in either register-register or register-immediate form
+    void arith(uint8_t rm_reg_opcode, int imm_ext, const Instr& instr)
+    {
+        if (instr.src.kind != Operand::Kind::imm) {
+            rm_reg(rm_reg_opcode, instr.dst, instr.src);
+        }
+        else if (fits_i8(instr.src.value)) {
+            rm_ext({ 0x83 }, imm_ext, instr.dst);
+            byte(instr.src.value);
+        }
+        else if (fits_i32(instr.src.value)) {
+            rm_ext({ 0x81 }, imm_ext, instr.dst);
+            bytes(instr.src.value, 4);
+        }
+        else {
+            unsupported();
+        }
+    }
+
+    void mov(const Instr& instr)
+    {
+        const Operand& dst = instr.dst;
+        const Operand& src = instr.src;
+        if (src.kind == Operand::Kind::imm && dst.kind == Operand::Kind::reg) {
+            int reg = num(dst.reg);
+            if (fits_i32(src.value)) {
+                rm_ext({ 0xC7 }, 0, dst); // sign-extended imm32
+                bytes(src.value, 4);
+            }
+            else if (src.value > 0 && src.value <= std::numeric_limits<uint32_t>::max()) {
+                rex(false, 0, dst); // mov r32, imm32 zero-extends
+                byte(0xB8 + (reg & 7));
+                bytes(src.value, 4);
+            }
+            else {
+                rex(true, 0, dst);
+                byte(0xB8 + (reg & 7));
+                bytes(src.value, 8);
+            }
+        }
+        else if (src.kind == Operand::Kind::reg) {
+            rm_reg(0x89, dst, src);
+        }
+        else if (src.kind == Operand::Kind::mem && dst.kind == Operand::Kind::reg) {
+            rm_reg(0x8B, src, dst);
+        }
+        else {
+            unsupported();
+        }
+    }
+
+    void jump(std::initializer_list<uint8_t> opcode, const Operand& target)
+    {
+        for (uint8_t op : opcode) {
+            byte(op);
+        }
+        m_fixups.push_back({ .offset = m_code.size(), .label = static_cast<size_t>(target.value) });
+        bytes(0, 4);
+    }
+
+    void encode_instr(const Instr& instr)
+    {
+        m_current = &instr;
+        switch (instr.op) {
+        case Op::nop:
+        case Op::comment:
+            break;
+        case Op::label: {
+            auto label = static_cast<size_t>(instr.dst.value);
+            if (label >= m_labels.size()) {
+                m_labels.resize(label + 1);
+            }
+            m_labels[label] = m_code.size();
+            break;
+        }
+        case Op::mov:
+            mov(instr);
+            break;
+        case Op::push:
+            if (instr.dst.kind == Operand::Kind::reg) {
+                rex(false, 0, instr.dst);
+                byte(0x50 + (num(instr.dst.reg) & 7));
+            }
+            else if (instr.dst.kind == Operand::Kind::imm && fits_i8(instr.dst.value)) {
+                byte(0x6A);
+                byte(instr.dst.value);
+            }
+            else if (instr.dst.kind == Operand::Kind::imm && fits_i32(instr.dst.value)) {
+                byte(0x68);
+                bytes(instr.dst.value, 4);
+            }
+            else if (instr.dst.kind == Operand::Kind::mem) {
+                rex(false, 0, instr.dst); // push defaults to 64 bits
+                byte(0xFF);
+                modrm(6, instr.dst);
+            }
+            else {
+                unsupported();
+            }
+            break;
+        case Op::pop:
+            if (instr.dst.kind != Operand::Kind::reg) {
+                unsupported();
+            }
+            rex(false, 0, instr.dst);
+            byte(0x58 + (num(instr.dst.reg) & 7));
+            break;
+        case Op::add:
+            arith(0x01, 0, instr);
+            break;
+        case Op::sub:
+            arith(0x29, 5, instr);
+            break;
+        case Op::xor_:
+            arith(0x31, 6, instr);
+            break;
+        case Op::test:
+            rm_reg(0x85, instr.dst, instr.src);
+            break;
+        case Op::cmp:
+            arith(0x39, 7, instr);
+            break;
+        case Op::xchg:
+            rm_reg(0x87, instr.dst, instr.src);
+            break;
+        case Op::imul:
+            if (instr.dst.kind != Operand::Kind::reg) {
+                unsupported();
+            }
+            if (instr.src.kind == Operand::Kind::imm) {
+                // imul r64, r/m64, imm with the destination as the source too
+                if (!fits_i32(instr.src.value)) {
+                    unsupported();
+                }
+                rex(true, num(instr.dst.reg), instr.dst);
+                byte(fits_i8(instr.src.value) ? 0x6B : 0x69);
+                modrm(num(instr.dst.reg), instr.dst);
+                bytes(instr.src.value, fits_i8(instr.src.value) ? 1 : 4);
+                break;
+            }
+            rex(true, num(instr.dst.reg), instr.src);
+            byte(0x0F);
+            byte(0xAF);
+            modrm(num(instr.dst.reg), instr.src);
+            break;
+        case Op::shl:
+        case Op::shr:
+            if (instr.src.kind != Operand::Kind::imm || instr.src.value < 0 || instr.src.value > 63) {
+                unsupported();
+            }
+            rm_ext({ 0xC1 }, instr.op == Op::shl ? 4 : 5, instr.dst);
+            byte(instr.src.value);
+            break;
+        case Op::lea:
+            if (instr.dst.kind != Operand::Kind::reg || instr.src.kind != Operand::Kind::mem) {
+                unsupported();
+            }
+            rm_reg(0x8D, instr.src, instr.dst);
+            break;
+        case Op::mul:
+            rm_ext({ 0xF7 }, 4, instr.dst);
+            break;
+        case Op::div:
+            rm_ext({ 0xF7 }, 6, instr.dst);
+            break;
+        case Op::neg:
+            rm_ext({ 0xF7 }, 3, instr.dst);
+            break;
+        case Op::jz:
+            jump({ 0x0F, 0x84 }, instr.dst);
+            break;
+        case Op::jae:
+            jump({ 0x0F, 0x83 }, instr.dst);
+            break;
+        case Op::jbe:
+            jump({ 0x0F, 0x86 }, instr.dst);
+            break;
+        case Op::jmp:
+            jump({ 0xE9 }, instr.dst);
+            break;
+        case Op::call:
+            jump({ 0xE8 }, instr.dst);
+            break;
+        case Op::ret:
+            byte(0xC3);
+            break;
+        case Op::syscall:
+            byte(0x0F);
+            byte(0x05);
+            break;
+        case Op::setb:
+        case Op::seta:
+            if (instr.dst.kind != Operand::Kind::reg) {
+                unsupported();
+            }
+            // without a REX prefix, 4-7 would be ah, ch, dh and bh
+            if (num(instr.dst.reg) >= 4) {
+                byte(0x40 | ((num(instr.dst.reg) & 8) ? 1 : 0));
+            }
+            byte(0x0F);
+            byte(instr.op == Op::setb ? 0x92 : 0x97);
+            modrm(0, instr.dst);
+            break;
+        case Op::movzx:
+            if (instr.dst.kind != Operand::Kind::reg || instr.src.kind != Operand::Kind::reg) {
+                unsupported();
+            }
+            rex(true, num(instr.dst.reg), instr.src);
+            byte(0x0F);
+            byte(0xB6);
+            modrm(num(instr.dst.reg), instr.src);
+            break;
+        }
+    }
+
+    [[noreturn]] void unsupported() const
+    {
+        compile_error("Cannot encode instruction: ", op_name(m_current->op));
+    }
+
+    const Instr* m_current = nullptr;
+    std::vector<uint8_t> m_code;
+    std::vector<std::optional<size_t>> m_labels;
+    std::vector<Fixup> m_fixups;
+};
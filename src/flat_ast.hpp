@@ -0,0 +1,552 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+#include "./json.hpp"
+#include "./parser.hpp"
+
+// Flat AST: every node of a program lives in one contiguous array and refers to its
+// children by 32-bit index instead of through NodeExpr -> variant -> NodeBinExpr ->
+// variant -> node pointer chains. Names and literal text are interned into a string
+// table, so the whole tree is position independent and holds no pointers.
+
+enum class NodeKind : uint8_t {
+    int_lit, // a: string id of the literal text
+    ident, // a: string id of the name
+    paren, // a: inner expression
+    add, // a: lhs, b: rhs
+    sub, // a: lhs, b: rhs
+    multi, // a: lhs, b: rhs
+    div, // a: lhs, b: rhs
+    exit, // a: expression
+    let, // a: string id of the name, b: expression
+    scope, // a: first entry in `lists`, b: number of statements
+    if_, // a: condition, b: scope
+    function, // a: string id of the name, b: entry in `lists` holding [scope, parameter count, parameter string ids...]
+    prog, // a: first entry in `lists`, b: number of statements
+    call, // a: string id of the function's name, b: entry in `lists` holding [argument count, arguments...]
+    return_, // a: expression
+    less_than, // a: lhs, b: rhs
+    greater_than, // a: lhs, b: rhs
+};
+
+struct FlatNode {
+    NodeKind kind;
+    uint32_t a;
+    uint32_t b;
+};
+
+static_assert(sizeof(FlatNode) == 12);
+
+// Non-owning view over a flat AST. This is what the printers and Generator consume,
+// whether the arrays are owned by a FlatAst or come from somewhere else.
+struct FlatAstView {
+    std::span<const FlatNode> nodes;
+    std::span<const uint32_t> lists; // child node indices and function parameter ids
+    std::span<const uint32_t> string_offsets; // string i is [offsets[i], offsets[i + 1])
+    std::string_view string_data;
+    uint32_t root;
+
+    [[nodiscard]] inline const FlatNode& node(uint32_t index) const
+    {
+        return nodes[index];
+    }
+
+    [[nodiscard]] inline std::string_view str(uint32_t id) const
+    {
+        return string_data.substr(string_offsets[id], string_offsets[id + 1] - string_offsets[id]);
+    }
+
+    // statements of a scope or prog node
+    [[nodiscard]] inline std::span<const uint32_t> stmts(const FlatNode& node) const
+    {
+        return lists.subspan(node.a, node.b);
+    }
+
+    [[nodiscard]] inline uint32_t function_scope(const FlatNode& func) const
+    {
+        return lists[func.b];
+    }
+
+    [[nodiscard]] inline std::span<const uint32_t> function_params(const FlatNode& func) const
+    {
+        return lists.subspan(func.b + 2, lists[func.b + 1]);
+    }
+
+    [[nodiscard]] inline std::span<const uint32_t> call_args(const FlatNode& call) const
+    {
+        return lists.subspan(call.b + 1, lists[call.b]);
+    }
+};
+
+struct FlatAst {
+    std::vector<FlatNode> nodes;
+    std::vector<uint32_t> lists;
+    std::vector<uint32_t> string_offsets { 0 };
+    std::string string_data;
+    uint32_t root = 0;
+
+    [[nodiscard]] inline FlatAstView view() const
+    {
+        return { .nodes = nodes, .lists = lists, .string_offsets = string_offsets, .string_data = string_data, .root = root };
+    }
+
+    [[nodiscard]] inline std::string_view str(uint32_t id) const
+    {
+        return std::string_view(string_data).substr(string_offsets[id], string_offsets[id + 1] - string_offsets[id]);
+    }
+};
+
+// Lowers the pointer AST built by Parser into a FlatAst. Children are emitted before
+// their parents, so walking the array front to back visits a tree bottom up.
+class Flattener {
+public:
+    inline explicit Flattener(FlatAst& ast)
+        : m_ast(ast)
+        , m_strings(0, StringHash { .ast = &ast }, StringEqual { .ast = &ast })
+    {
+    }
+
+    uint32_t flatten_term(const NodeTerm* term)
+    {
+        struct TermVisitor {
+            Flattener& flat;
+            uint32_t operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                return flat.push({ .kind = NodeKind::int_lit, .a = flat.intern(term_int_lit->int_lit.value.value()), .b = 0 });
+            }
+            uint32_t operator()(const NodeTermIdent* term_ident) const
+            {
+                return flat.push({ .kind = NodeKind::ident, .a = flat.intern(term_ident->ident), .b = 0 });
+            }
+            uint32_t operator()(const NodeTermParen* term_paren) const
+            {
+                return flat.push({ .kind = NodeKind::paren, .a = flat.flatten_expr(term_paren->expr), .b = 0 });
+            }
+            uint32_t operator()(const NodeTermCall* term_call) const
+            {
+                // arguments may hold calls with lists of their own, so they are
+                // all flattened before this call's list is written
+                size_t start = flat.m_scratch.size();
+                for (const NodeExpr* arg : term_call->args) {
+                    flat.m_scratch.push_back(flat.flatten_expr(arg));
+                }
+                auto entry = static_cast<uint32_t>(flat.m_ast.lists.size());
+                flat.m_ast.lists.push_back(static_cast<uint32_t>(term_call->args.size()));
+                flat.m_ast.lists.insert(flat.m_ast.lists.end(), flat.m_scratch.begin() + static_cast<ptrdiff_t>(start), flat.m_scratch.end());
+                flat.m_scratch.resize(start);
+                return flat.push({ .kind = NodeKind::call, .a = flat.intern(term_call->ident), .b = entry });
+            }
+        };
+        return std::visit(TermVisitor { .flat = *this }, term->var);
+    }
+
+    uint32_t flatten_bin_expr(const NodeBinExpr* bin_expr)
+    {
+        struct BinExprVisitor {
+            Flattener& flat;
+            uint32_t operator()(const NodeBinExprAdd* add) const
+            {
+                return flat.push_bin(NodeKind::add, add->lhs, add->rhs);
+            }
+            uint32_t operator()(const NodeBinExprSub* sub) const
+            {
+                return flat.push_bin(NodeKind::sub, sub->lhs, sub->rhs);
+            }
+            uint32_t operator()(const NodeBinExprMulti* multi) const
+            {
+                return flat.push_bin(NodeKind::multi, multi->lhs, multi->rhs);
+            }
+            uint32_t operator()(const NodeBinExprDiv* div) const
+            {
+                return flat.push_bin(NodeKind::div, div->lhs, div->rhs);
+            }
+            uint32_t operator()(const NodeBinExprLessThan* less_than) const
+            {
+                return flat.push_bin(NodeKind::less_than, less_than->lhs, less_than->rhs);
+            }
+            uint32_t operator()(const NodeBinExprGreaterThan* greater_than) const
+            {
+                return flat.push_bin(NodeKind::greater_than, greater_than->lhs, greater_than->rhs);
+            }
+        };
+        return std::visit(BinExprVisitor { .flat = *this }, bin_expr->var);
+    }
+
+    uint32_t flatten_expr(const NodeExpr* expr)
+    {
+        struct ExprVisitor {
+            Flattener& flat;
+            uint32_t operator()(const NodeTerm* term) const
+            {
+                return flat.flatten_term(term);
+            }
+            uint32_t operator()(const NodeBinExpr* bin_expr) const
+            {
+                return flat.flatten_bin_expr(bin_expr);
+            }
+        };
+        return std::visit(ExprVisitor { .flat = *this }, expr->var);
+    }
+
+    uint32_t flatten_scope(const NodeScope* scope)
+    {
+        return push_list(NodeKind::scope, scope->stmts);
+    }
+
+    uint32_t flatten_stmt(const NodeStmt* stmt)
+    {
+        struct StmtVisitor {
+            Flattener& flat;
+            uint32_t operator()(const NodeStmtExit* stmt_exit) const
+            {
+                return flat.push({ .kind = NodeKind::exit, .a = flat.flatten_expr(stmt_exit->expr), .b = 0 });
+            }
+            uint32_t operator()(const NodeStmtLet* stmt_let) const
+            {
+                uint32_t name = flat.intern(stmt_let->ident);
+                return flat.push({ .kind = NodeKind::let, .a = name, .b = flat.flatten_expr(stmt_let->expr) });
+            }
+            uint32_t operator()(const NodeScope* scope) const
+            {
+                return flat.flatten_scope(scope);
+            }
+            uint32_t operator()(const NodeStmtIf* stmt_if) const
+            {
+                uint32_t cond = flat.flatten_expr(stmt_if->expr);
+                return flat.push({ .kind = NodeKind::if_, .a = cond, .b = flat.flatten_scope(stmt_if->scope) });
+            }
+            uint32_t operator()(const NodeStmtFunction* func) const
+            {
+                uint32_t scope = flat.flatten_scope(func->scope);
+                auto entry = static_cast<uint32_t>(flat.m_ast.lists.size());
+                flat.m_ast.lists.push_back(scope);
+                flat.m_ast.lists.push_back(static_cast<uint32_t>(func->parameters.size()));
+                for (const Token& param : func->parameters) {
+                    flat.m_ast.lists.push_back(flat.intern(param));
+                }
+                return flat.push({ .kind = NodeKind::function, .a = flat.intern(func->ident), .b = entry });
+            }
+            uint32_t operator()(const NodeStmtReturn* stmt_return) const
+            {
+                return flat.push({ .kind = NodeKind::return_, .a = flat.flatten_expr(stmt_return->expr), .b = 0 });
+            }
+        };
+        return std::visit(StmtVisitor { .flat = *this }, stmt->var);
+    }
+
+    uint32_t flatten_prog(const NodeProg& prog)
+    {
+        m_ast.root = push_list(NodeKind::prog, prog.stmts);
+        return m_ast.root;
+    }
+
+    // Flattens one top-level statement as a program of its own, replacing the nodes
+    // of the previous one. The string table is kept, so string ids stay the same
+    // from one statement to the next.
+    uint32_t flatten_top_level(NodeStmt* stmt)
+    {
+        m_ast.nodes.clear();
+        m_ast.lists.clear();
+        m_ast.root = push_list(NodeKind::prog, std::span<NodeStmt* const>(&stmt, 1));
+        return m_ast.root;
+    }
+
+private:
+    inline uint32_t push(FlatNode node)
+    {
+        m_ast.nodes.push_back(node);
+        return static_cast<uint32_t>(m_ast.nodes.size() - 1);
+    }
+
+    inline uint32_t push_bin(NodeKind kind, const NodeExpr* lhs, const NodeExpr* rhs)
+    {
+        uint32_t flat_lhs = flatten_expr(lhs);
+        return push({ .kind = kind, .a = flat_lhs, .b = flatten_expr(rhs) });
+    }
+
+    // Statements are flattened first (they append lists of their own), then the
+    // finished child indices are copied into `lists` as one contiguous run.
+    inline uint32_t push_list(NodeKind kind, std::span<NodeStmt* const> stmts)
+    {
+        size_t start = m_scratch.size();
+        for (const NodeStmt* stmt : stmts) {
+            m_scratch.push_back(flatten_stmt(stmt));
+        }
+        auto first = static_cast<uint32_t>(m_ast.lists.size());
+        m_ast.lists.insert(m_ast.lists.end(), m_scratch.begin() + static_cast<ptrdiff_t>(start), m_scratch.end());
+        m_scratch.resize(start);
+        return push({ .kind = kind, .a = first, .b = static_cast<uint32_t>(stmts.size()) });
+    }
+
+    // identifiers were interned by the Tokenizer, so their string ids are found by symbol
+    inline uint32_t intern(const Token& ident)
+    {
+        if (ident.symbol >= m_symbol_strings.size()) {
+            m_symbol_strings.resize(ident.symbol + 1, no_string);
+        }
+        uint32_t& id = m_symbol_strings[ident.symbol];
+        if (id == no_string) {
+            id = intern(ident.value.value());
+        }
+        return id;
+    }
+
+    inline uint32_t intern(std::string_view str)
+    {
+        auto it = m_strings.find(str);
+        if (it != m_strings.end()) {
+            return *it;
+        }
+        auto id = static_cast<uint32_t>(m_ast.string_offsets.size() - 1);
+        m_ast.string_data.append(str);
+        m_ast.string_offsets.push_back(static_cast<uint32_t>(m_ast.string_data.size()));
+        m_strings.insert(id);
+        return id;
+    }
+
+    static constexpr uint32_t no_string = UINT32_MAX;
+
+    // The interned set holds string ids and looks their text up in the table, so it
+    // never points at a token or folded literal that may since have been freed.
+    struct StringHash {
+        using is_transparent = void;
+        const FlatAst* ast;
+        size_t operator()(std::string_view str) const
+        {
+            return std::hash<std::string_view> {}(str);
+        }
+        size_t operator()(uint32_t id) const
+        {
+            return (*this)(ast->str(id));
+        }
+    };
+
+    struct StringEqual {
+        using is_transparent = void;
+        const FlatAst* ast;
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return a == b;
+        }
+        bool operator()(std::string_view a, uint32_t b) const
+        {
+            return a == ast->str(b);
+        }
+        bool operator()(uint32_t a, std::string_view b) const
+        {
+            return ast->str(a) == b;
+        }
+    };
+
+    FlatAst& m_ast;
+    std::unordered_set<uint32_t, StringHash, StringEqual> m_strings;
+    std::vector<uint32_t> m_symbol_strings; // string id of each symbol, by symbol
+    std::vector<uint32_t> m_scratch;
+};
+
+inline FlatAst flatten(const NodeProg& prog)
+{
+    FlatAst ast;
+    Flattener(ast).flatten_prog(prog);
+    return ast;
+}
+
+// -------------------- PRETTY PRINTING - WRITE THE AST AS JSON ----------------------
+
+// Writes the tree as JSON in one pass, straight into the sink.
+class AstPrinter {
+public:
+    inline AstPrinter(FlatAstView ast, OutputSink& out, bool pretty = false)
+        : m_ast(ast)
+        , m_json(out, pretty)
+    {
+    }
+
+    void write_bin_expr(const FlatNode& bin_expr)
+    {
+        m_json.begin_object();
+        m_json.key("type");
+        switch (bin_expr.kind) {
+        case NodeKind::add:
+            m_json.string("add");
+            break;
+        case NodeKind::sub:
+            m_json.string("sub");
+            break;
+        case NodeKind::div:
+            m_json.string("div");
+            break;
+        case NodeKind::multi:
+            m_json.string("mul");
+            break;
+        case NodeKind::less_than:
+            m_json.string("less_than");
+            break;
+        case NodeKind::greater_than:
+            m_json.string("greater_than");
+            break;
+        default:
+            assert(false); // Unreachable - only called on binary expressions
+        }
+        m_json.key("left");
+        write_expr(bin_expr.a);
+        m_json.key("right");
+        write_expr(bin_expr.b);
+        m_json.end_object();
+    }
+
+    void write_term(const FlatNode& term)
+    {
+        m_json.begin_object();
+        switch (term.kind) {
+        case NodeKind::ident:
+            m_json.key("type");
+            m_json.string("identifier");
+            m_json.key("identifier");
+            m_json.string(m_ast.str(term.a));
+            break;
+        case NodeKind::int_lit:
+            m_json.key("type");
+            m_json.string("integer_literal");
+            m_json.key("value");
+            m_json.integer(m_ast.str(term.a));
+            break;
+        case NodeKind::paren:
+            m_json.key("type");
+            m_json.string("parenthesis");
+            m_json.key("value");
+            write_expr(term.a);
+            break;
+        case NodeKind::call:
+            m_json.key("type");
+            m_json.string("call");
+            m_json.key("identifier");
+            m_json.string(m_ast.str(term.a));
+            m_json.key("arguments");
+            m_json.begin_array();
+            for (uint32_t arg : m_ast.call_args(term)) {
+                write_expr(arg);
+            }
+            m_json.end_array();
+            break;
+        default:
+            assert(false); // Unreachable - only called on terms
+        }
+        m_json.end_object();
+    }
+
+    void write_expr(uint32_t expr)
+    {
+        const FlatNode& node = m_ast.node(expr);
+        m_json.begin_object();
+        switch (node.kind) {
+        case NodeKind::int_lit:
+        case NodeKind::ident:
+        case NodeKind::paren:
+        case NodeKind::call:
+            m_json.key("type");
+            m_json.string("term");
+            m_json.key("variant");
+            write_term(node);
+            break;
+        default:
+            m_json.key("type");
+            m_json.string("binary_expression");
+            m_json.key("operation");
+            write_bin_expr(node);
+        }
+        m_json.end_object();
+    }
+
+    void write_stmt(uint32_t stmt)
+    {
+        const FlatNode& node = m_ast.node(stmt);
+        m_json.begin_object();
+        switch (node.kind) {
+        case NodeKind::exit:
+            m_json.key("type");
+            m_json.string("exit_statement");
+            m_json.key("expression");
+            write_expr(node.a);
+            break;
+        case NodeKind::function:
+            m_json.key("type");
+            m_json.string("function_statement");
+            m_json.key("identifier");
+            m_json.string(m_ast.str(node.a));
+            m_json.key("parameters");
+            m_json.begin_array();
+            for (uint32_t param : m_ast.function_params(node)) {
+                m_json.string(m_ast.str(param));
+            }
+            m_json.end_array();
+            m_json.key("body");
+            write_stmts(m_ast.node(m_ast.function_scope(node)));
+            break;
+        case NodeKind::if_:
+            m_json.key("type");
+            m_json.string("if_statement");
+            m_json.key("expression");
+            write_expr(node.a);
+            m_json.key("body");
+            write_stmts(m_ast.node(node.b));
+            break;
+        case NodeKind::let:
+            m_json.key("type");
+            m_json.string("var_declaration_statement");
+            m_json.key("identifier");
+            m_json.string(m_ast.str(node.a));
+            m_json.key("expression");
+            write_expr(node.b);
+            break;
+        case NodeKind::scope:
+            m_json.key("type");
+            m_json.string("scope");
+            m_json.key("body");
+            write_stmts(node);
+            break;
+        case NodeKind::return_:
+            m_json.key("type");
+            m_json.string("return_statement");
+            m_json.key("expression");
+            write_expr(node.a);
+            break;
+        default:
+            assert(false); // Unreachable - only called on statements
+        }
+        m_json.end_object();
+    }
+
+    void write_prog()
+    {
+        m_json.begin_object();
+        m_json.key("type");
+        m_json.string("program");
+        m_json.key("statements");
+        write_stmts(m_ast.node(m_ast.root));
+        m_json.end_object();
+        m_json.finish();
+    }
+
+private:
+    // the statements of a scope or prog node, as an array
+    void write_stmts(const FlatNode& node)
+    {
+        m_json.begin_array();
+        for (uint32_t stmt : m_ast.stmts(node)) {
+            write_stmt(stmt);
+        }
+        m_json.end_array();
+    }
+
+    const FlatAstView m_ast;
+    JsonWriter m_json;
+};
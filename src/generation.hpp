@@ -1,214 +1,1441 @@
 #pragma once
 
-#include "./parser.hpp"
+#include "./call_graph.hpp"
+#include "./compile_error.hpp"
+#include "./encoder.hpp"
+#include "./flat_ast.hpp"
+#include "./instructions.hpp"
+#include "./peephole.hpp"
+#include "./profile.hpp"
 #include <cassert>
 #include <algorithm>
+#include <bit>
+#include <charconv>
+#include <iterator>
+#include <span>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <sstream>
 
+struct GeneratorOptions {
+    // keep temporaries and the most used variables in registers instead of pushing
+    // everything through the stack
+    bool regalloc = false;
+    // arithmetic with a constant operand uses immediates, shifts, lea and reciprocal
+    // multiplies instead of loading the constant and running mul or div
+    bool strength_reduce = true;
+    // clean up the instruction list before rendering it
+    bool peephole = true;
+    PeepholeOptions peephole_options {};
+    // expand calls to small functions, and to functions called from one place,
+    // where they are made; only gen_prog sees enough of the program to do this
+    bool inline_functions = true;
+    // largest body, in AST nodes, inlined at every call
+    size_t inline_limit = 32;
+    // leave out the functions no call from the program can reach
+    bool drop_dead_functions = true;
+    // leave out statements nothing reaches, `if`s that can't run, variables that
+    // are never read and stack adjustments by zero
+    bool eliminate_dead_code = true;
+};
+
 class Generator {
 public:
-    inline explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
+    inline explicit Generator(FlatAstView ast, GeneratorOptions options = {})
+        : m_ast(ast)
+        , m_options(options)
+    {
+    }
+
+    // for streaming, where the statements arrive through gen_top_level
+    inline explicit Generator(GeneratorOptions options = {})
+        : m_options(options)
+    {
+    }
+
+    void gen_term(const FlatNode& term)
+    {
+        switch (term.kind) {
+        case NodeKind::int_lit: {
+            comment("push ", m_ast.str(term.a), " onto stack");
+            Operand value = int_lit(term);
+            if (m_options.strength_reduce && fits_imm32(value.value)) {
+                push(value);
+                break;
+            }
+            emit(Op::mov, reg_op(Reg::rax), value);
+            push(reg_op(Reg::rax));
+            break;
+        }
+        case NodeKind::ident: {
+            const Var& var = lookup_var(term.a);
+            comment("access variable ", m_ast.str(term.a), " and push to stack");
+            push(var_op(var));
+            break;
+        }
+        case NodeKind::paren:
+            gen_expr(term.a);
+            break;
+        case NodeKind::call: {
+            std::span<const uint32_t> args = m_ast.call_args(term);
+            uint32_t label = function(term.a, args.size()).label;
+            if (std::optional<uint32_t> func = inline_definition(term)) {
+                gen_inline_call(term, m_ast.node(func.value()), {});
+                break;
+            }
+            comment("call ", m_ast.str(term.a), " and push its result");
+            for (uint32_t arg : args) {
+                gen_expr(arg);
+            }
+            for (size_t i = args.size(); i > 0; i--) {
+                pop(arg_regs[i - 1]);
+            }
+            emit(Op::call, label_op(label));
+            m_calls->push_back(term.a);
+            push(reg_op(Reg::rax));
+            break;
+        }
+        default:
+            assert(false); // Unreachable - only called on terms
+        }
+    }
+
+    void gen_bin_expr(const FlatNode& bin_expr)
+    {
+        if (std::optional<ConstOperand> constant = const_operand(bin_expr)) {
+            gen_expr(constant->other);
+            pop(Reg::rax);
+            gen_const_op(bin_expr.kind, Reg::rax, constant.value());
+            push(reg_op(Reg::rax));
+            return;
+        }
+        gen_expr(bin_expr.b);
+        gen_expr(bin_expr.a);
+        pop(Reg::rax);
+        pop(Reg::rbx);
+        switch (bin_expr.kind) {
+        case NodeKind::sub:
+            emit(Op::sub, reg_op(Reg::rax), reg_op(Reg::rbx));
+            break;
+        case NodeKind::add:
+            emit(Op::add, reg_op(Reg::rax), reg_op(Reg::rbx));
+            break;
+        case NodeKind::multi:
+            emit(Op::mul, reg_op(Reg::rbx));
+            break;
+        case NodeKind::div:
+            emit(Op::xor_, reg_op(Reg::rdx), reg_op(Reg::rdx));
+            emit(Op::div, reg_op(Reg::rbx));
+            break;
+        case NodeKind::less_than:
+        case NodeKind::greater_than:
+            emit(Op::cmp, reg_op(Reg::rax), reg_op(Reg::rbx));
+            gen_set(bin_expr.kind, Reg::rax);
+            break;
+        default:
+            assert(false); // Unreachable - only called on binary expressions
+        }
+        push(reg_op(Reg::rax));
+    }
+
+    void gen_expr(uint32_t expr)
     {
+        const FlatNode& node = m_ast.node(expr);
+        switch (node.kind) {
+        case NodeKind::int_lit:
+        case NodeKind::ident:
+        case NodeKind::paren:
+        case NodeKind::call:
+            gen_term(node);
+            break;
+        default:
+            gen_bin_expr(node);
+        }
+    }
+
+    void gen_scope(uint32_t scope)
+    {
+        begin_scope();
+        if (m_options.regalloc) {
+            assign_let_regs(scope);
+        }
+        std::span<const uint32_t> stmts = m_ast.stmts(m_ast.node(scope));
+        size_t i = 0;
+        for (; i < stmts.size() && !unreachable(); i++) {
+            gen_stmt(stmts[i]);
+        }
+        // the registers handed to the `let`s left out are never taken back by end_scope
+        for (; i < stmts.size(); i++) {
+            if (auto reg = m_let_regs.find(stmts[i]); reg != m_let_regs.end()) {
+                free_reg(reg->second);
+            }
+        }
+        end_scope();
     }
 
-    void gen_term(const NodeTerm* term)
+    void gen_stmt(uint32_t stmt)
     {
-        struct TermVisitor {
-            Generator& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const
-            {
-                gen.m_output << "    ; push " << term_int_lit->int_lit.value.value() << " onto stack\n";
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
+        const FlatNode& node = m_ast.node(stmt);
+        switch (node.kind) {
+        case NodeKind::exit:
+            comment("generate code for exiting");
+            if (m_options.regalloc) {
+                Reg reg = alloc_reg().value();
+                gen_expr_reg(node.a, reg);
+                comment("exit with code generated above");
+                emit(Op::mov, reg_op(Reg::rax), imm_op(60));
+                mov(Reg::rdi, reg_op(reg));
+                free_reg(reg);
+            }
+            else {
+                gen_expr(node.a);
+                comment("exit with code generated above");
+                emit(Op::mov, reg_op(Reg::rax), imm_op(60));
+                pop(Reg::rdi);
+            }
+            emit(Op::syscall);
+            m_reachable = false;
+            break;
+        case NodeKind::let: {
+            if (find_var(node.a) != nullptr) {
+                compile_error("Identifier already used: ", m_ast.str(node.a));
             }
-            void operator()(const NodeTermIdent* term_ident) const
-            {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+            if (unused_let(node)) {
+                // only evaluated for what it does, if anything
+                if (!pure(node.b) && m_options.regalloc) {
+                    Reg tmp = alloc_reg().value();
+                    gen_expr_reg(node.b, tmp);
+                    free_reg(tmp);
                 }
-                std::stringstream offset;
-                gen.m_output << "    ; access variable " << term_ident->ident.value.value() << " and push to stack\n";
-                offset << "QWORD [rsp + " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.push(offset.str());
+                else if (!pure(node.b)) {
+                    gen_expr(node.b);
+                    pop(Reg::rax);
+                }
+                declare({ .name = node.a, .stack_loc = 0, .dropped = true });
             }
-            void operator()(const NodeTermParen* term_paren) const
-            {
-                gen.gen_expr(term_paren->expr);
+            else if (!m_options.regalloc) {
+                // declared after its value, so the initializer can't read the variable itself
+                gen_expr(node.b);
+                declare({ .name = node.a, .stack_loc = m_stack_size - 1 });
             }
-        };
-        TermVisitor visitor({ .gen = *this });
-        std::visit(visitor, term->var);
-    }
-
-    void gen_bin_expr(const NodeBinExpr* bin_expr)
-    {
-        struct BinExprVisitor {
-            Generator& gen;
-            void operator()(const NodeBinExprSub* sub) const
-            {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.m_output << "    ; \n";
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprAdd* add) const
-            {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprMulti* multi) const
-            {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprDiv* div) const
-            {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
+            else if (auto reg = m_let_regs.find(stmt); reg != m_let_regs.end()) {
+                gen_expr_reg(node.b, reg->second);
+                declare({ .name = node.a, .stack_loc = 0, .reg = reg->second });
             }
-        };
+            else {
+                Reg tmp = alloc_reg().value();
+                gen_expr_reg(node.b, tmp);
+                declare({ .name = node.a, .stack_loc = m_stack_size });
+                push(reg_op(tmp));
+                free_reg(tmp);
+            }
+            break;
+        }
+        case NodeKind::scope:
+            gen_scope(stmt);
+            break;
+        case NodeKind::if_: {
+            if (std::optional<uint64_t> known = constant(node.a); known.has_value() && m_options.eliminate_dead_code) {
+                if (known.value() != 0) {
+                    gen_scope(node.b);
+                }
+                break;
+            }
+            size_t start = m_assembly.instrs.size();
+            uint32_t label = create_label();
+            emit(gen_cond(node.a), label_op(label));
+            size_t jump = m_assembly.instrs.size() - 1;
+            gen_scope(node.b);
+            bool empty = std::all_of(m_assembly.instrs.begin() + static_cast<ptrdiff_t>(jump) + 1, m_assembly.instrs.end(), [](const Instr& instr) {
+                return instr.op == Op::comment;
+            });
+            if (empty && m_options.eliminate_dead_code) {
+                // nothing to skip over; keep the condition only for what it does
+                if (pure(node.a)) {
+                    m_assembly.instrs.resize(start);
+                    break;
+                }
+                m_assembly.instrs.resize(jump);
+                if (m_assembly.instrs.back().op == Op::test || m_assembly.instrs.back().op == Op::cmp) {
+                    m_assembly.instrs.pop_back();
+                }
+                break;
+            }
+            emit(Op::label, label_op(label));
+            m_reachable = true;
+            break;
+        }
+        case NodeKind::function:
+            define_function(stmt);
+            break;
+        case NodeKind::return_:
+            if (!m_return.has_value()) {
+                compile_error("`return` outside of a function");
+            }
+            comment("return the value generated below");
+            if (m_options.regalloc && m_return->reg.has_value()) {
+                gen_expr_reg(node.a, m_return->reg.value());
+            }
+            else if (m_options.regalloc) {
+                Reg reg = alloc_reg().value();
+                gen_expr_reg(node.a, reg);
+                mov(Reg::rax, reg_op(reg));
+                free_reg(reg);
+            }
+            else {
+                gen_expr(node.a);
+                pop(Reg::rax);
+            }
+            // m_stack_size stays put: whatever follows is generated for the stack as it is here
+            emit(Op::add, reg_op(Reg::rsp), imm_op(static_cast<int64_t>((m_stack_size - m_return->stack_base) * 8)));
+            emit(Op::jmp, label_op(m_return->label));
+            m_return->taken = true;
+            m_reachable = false;
+            break;
+        default:
+            assert(false); // Unreachable - only called on statements
+        }
+    }
+
+    // Generates the whole program and writes its NASM source to `out`, and its
+    // machine code to `encoder` if there is one. The sink is not finished, so the
+    // caller can still append to it or pick how it is flushed.
+    //
+    // With the whole program at hand, function bodies wait until the top-level
+    // code has been generated: only then is it known which ones are still called
+    // once small functions have been inlined.
+    void gen_prog(OutputSink& out, Encoder* encoder = nullptr)
+    {
+        begin_prog(out, encoder);
+        if (m_options.inline_functions) {
+            m_call_graph.emplace(m_ast, m_options.inline_limit);
+        }
+        m_whole_program = true;
+        gen_stmts(m_ast);
+        end_prog();
+    }
+
+    // Streaming compilation: begin_prog, then gen_top_level for each top-level
+    // statement as it is parsed, then end_prog. Every call gets a flat AST of its
+    // own, but string ids have to mean the same name throughout. The code for each
+    // statement is optimized and written out before the call returns, so the peephole
+    // pass does not look across statements.
+    void begin_prog(OutputSink& out, Encoder* encoder = nullptr)
+    {
+        m_out = &out;
+        m_encoder = encoder;
+        render_nasm_header(out);
+    }
+
+    void gen_top_level(FlatAstView ast)
+    {
+        gen_stmts(ast);
+        flush();
+    }
+
+    // Function bodies were set aside as they were generated and go after the
+    // program's final exit, where falling off the end of the program can't reach
+    // them. Those no call from the top-level code leads to are dropped.
+    void end_prog()
+    {
+        gen_deferred_functions();
+        const Function* undefined = nullptr;
+        for (const auto& [name, function] : m_functions) {
+            if (!function.defined && (undefined == nullptr || function.label < undefined->label)) {
+                undefined = &function;
+            }
+        }
+        if (undefined != nullptr) {
+            compile_error("Undeclared function: ", undefined->name);
+        }
+        if (!unreachable()) {
+            emit(Op::mov, reg_op(Reg::rax), imm_op(60));
+            emit(Op::mov, reg_op(Reg::rdi), imm_op(0));
+            emit(Op::syscall);
+        }
+        flush();
+        if (m_options.drop_dead_functions) {
+            mark_reachable();
+        }
+        for (uint32_t name : m_definition_order) {
+            Function& function = m_functions.at(name);
+            if (function.reachable || !m_options.drop_dead_functions) {
+                m_assembly = std::move(function.code);
+                flush();
+            }
+        }
+    }
+
+    // times the peephole pass, rendering and encoding as phases of their own
+    inline void set_profiler(Profiler* profiler)
+    {
+        m_profiler = profiler;
+    }
+
+    [[nodiscard]] const PeepholeStats& peephole_stats() const
+    {
+        return m_peephole_stats;
+    }
+
+private:
+    // the statements of `ast`'s root
+    void gen_stmts(FlatAstView ast)
+    {
+        m_ast = ast;
+        if (m_options.regalloc || m_options.eliminate_dead_code) {
+            number_nodes();
+        }
+        if (m_options.regalloc) {
+            m_let_regs.clear(); // keyed by node index, which only means something in one AST
+            m_alloc_order = makes_calls(m_ast.root) ? std::span<const Reg>(caller_alloc_regs) : std::span<const Reg>(alloc_regs);
+            assign_let_regs(m_ast.root);
+        }
+        for (uint32_t stmt : m_ast.stmts(m_ast.node(m_ast.root))) {
+            // definitions still count after an exit, nothing else does
+            if (!unreachable() || m_ast.node(stmt).kind == NodeKind::function) {
+                gen_stmt(stmt);
+            }
+        }
+    }
+
+    // optimizes what has been emitted so far and hands it on
+    void flush()
+    {
+        if (m_options.peephole) {
+            ProfileScope scope(m_profiler, "peephole");
+            PeepholeStats stats = peephole(m_assembly.instrs, m_options.peephole_options);
+            for (size_t i = 0; i < peephole_rule_count; i++) {
+                m_peephole_stats.removed[i] += stats.removed[i];
+            }
+        }
+        {
+            ProfileScope scope(m_profiler, "render");
+            render_nasm_instrs(m_assembly, *m_out);
+        }
+        if (m_encoder != nullptr) {
+            ProfileScope scope(m_profiler, "encode");
+            m_encoder->encode(m_assembly.instrs);
+        }
+        if (m_profiler != nullptr) {
+            m_profiler->count("instructions", m_assembly.instrs.size());
+        }
+        m_assembly.instrs.clear();
+        m_assembly.comments.clear();
+    }
+
+    struct Var {
+        uint32_t name; // string id in the flat AST
+        size_t stack_loc;
+        std::optional<Reg> reg {}; // set when the variable lives in a register
+        uint32_t shadowed = no_var; // binding of the same name this one hides
+        bool dropped = false; // never read, so it has neither a register nor a stack slot
+    };
 
-        BinExprVisitor visitor { .gen = *this };
-        std::visit(visitor, bin_expr->var);
+    static constexpr uint32_t no_var = UINT32_MAX;
+
+    // -------------------- REGISTER ALLOCATION ----------------------
+    //
+    // Expressions are evaluated with Sethi-Ullman numbering: the operand needing more
+    // registers goes first, straight into the destination register, and the other one
+    // into a scratch register. Only when the pool runs dry is the first result spilled
+    // to the stack and reloaded into rax. `let` variables are given registers per scope
+    // in order of how often they are read, keeping enough free for expressions; the
+    // rest stay in stack slots exactly like the stack-machine backend.
+
+    // rax and rdx are left out: div and the exit syscall need them
+    static constexpr Reg alloc_regs[] = {
+        Reg::rbx, Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9,
+        Reg::r10, Reg::r11, Reg::r12, Reg::r13, Reg::r14, Reg::r15,
+    };
+    static constexpr int regs_kept_for_exprs = 4;
+
+    // Children always precede their parents in the flat AST, so one forward pass
+    // sees every operand before the operator that uses it.
+    void number_nodes()
+    {
+        m_need.resize(m_ast.nodes.size());
+        m_effects.resize(m_ast.nodes.size());
+        m_uses.resize(m_ast.string_offsets.size());
+        for (uint32_t i = 0; i < m_ast.nodes.size(); i++) {
+            const FlatNode& node = m_ast.nodes[i];
+            switch (node.kind) {
+            case NodeKind::int_lit:
+                m_need[i] = 1;
+                break;
+            case NodeKind::ident:
+                m_need[i] = 1;
+                m_uses[node.a]++;
+                break;
+            case NodeKind::paren:
+                m_need[i] = m_need[node.a];
+                m_effects[i] = m_effects[node.a];
+                break;
+            case NodeKind::add:
+            case NodeKind::sub:
+            case NodeKind::multi:
+            case NodeKind::div:
+            case NodeKind::less_than:
+            case NodeKind::greater_than: {
+                uint8_t lhs = m_need[node.a];
+                uint8_t rhs = m_need[node.b];
+                m_need[i] = lhs == rhs ? std::min(lhs + 1, 255) : std::max(lhs, rhs);
+                m_effects[i] = m_effects[node.a] || m_effects[node.b] || (node.kind == NodeKind::div && !nonzero_literal(node.b));
+                break;
+            }
+            case NodeKind::call:
+                // first, so as little as possible is live across the call
+                m_need[i] = static_cast<uint8_t>(std::size(alloc_regs));
+                m_effects[i] = true;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // whether `expr` is a literal other than zero, without reporting anything about it
+    [[nodiscard]] bool nonzero_literal(uint32_t expr) const
+    {
+        const FlatNode* node = &m_ast.node(expr);
+        while (node->kind == NodeKind::paren) {
+            node = &m_ast.node(node->a);
+        }
+        return node->kind == NodeKind::int_lit && m_ast.str(node->a).find_first_not_of('0') != std::string_view::npos;
     }
 
-    void gen_expr(const NodeExpr* expr)
+    // Hand registers to the `let`s directly inside `scope`, most read first.
+    void assign_let_regs(uint32_t scope)
     {
-        struct ExprVisitor {
-            Generator& gen;
-            void operator()(const NodeTerm* term) const
-            {
-                gen.gen_term(term);
+        std::vector<uint32_t> lets;
+        for (uint32_t stmt : m_ast.stmts(m_ast.node(scope))) {
+            if (m_ast.node(stmt).kind == NodeKind::let && !unused_let(m_ast.node(stmt))) {
+                lets.push_back(stmt);
             }
-            void operator()(const NodeBinExpr* bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
+        }
+        std::stable_sort(lets.begin(), lets.end(), [&](uint32_t a, uint32_t b) {
+            return m_uses[m_ast.node(a).a] > m_uses[m_ast.node(b).a];
+        });
+        for (uint32_t let : lets) {
+            // an inlined body is generated once per call, each time with other registers free
+            m_let_regs.erase(let);
+        }
+        for (uint32_t let : lets) {
+            if (free_reg_count() <= regs_kept_for_exprs) {
+                break;
+            }
+            m_let_regs[let] = alloc_reg().value();
+        }
+    }
+
+    // Returns a free register, if there is one.
+    std::optional<Reg> alloc_reg()
+    {
+        for (Reg reg : m_alloc_order) {
+            if (!(m_busy_regs & reg_bit(reg))) {
+                m_busy_regs |= reg_bit(reg);
+                return reg;
             }
+        }
+        return {};
+    }
+
+    void free_reg(Reg reg)
+    {
+        m_busy_regs &= ~reg_bit(reg);
+    }
+
+    [[nodiscard]] size_t free_reg_count() const
+    {
+        return std::size(alloc_regs) - std::popcount(m_busy_regs);
+    }
+
+    static uint32_t reg_bit(Reg reg)
+    {
+        return 1u << static_cast<int>(reg);
+    }
+
+    void mov(Reg dst, const Operand& src)
+    {
+        if (!src.is_reg(dst)) {
+            emit(Op::mov, reg_op(dst), src);
+        }
+    }
+
+    // Evaluate `expr` into register `dst`.
+    void gen_expr_reg(uint32_t expr, Reg dst)
+    {
+        const FlatNode& node = m_ast.node(expr);
+        switch (node.kind) {
+        case NodeKind::int_lit:
+            emit(Op::mov, reg_op(dst), int_lit(node));
+            break;
+        case NodeKind::ident:
+            mov(dst, var_op(lookup_var(node.a)));
+            break;
+        case NodeKind::paren:
+            gen_expr_reg(node.a, dst);
+            break;
+        case NodeKind::call:
+            gen_call_reg(node, dst);
+            break;
+        default:
+            gen_bin_expr_reg(node, dst);
+        }
+    }
+
+    void gen_bin_expr_reg(const FlatNode& bin_expr, Reg dst)
+    {
+        if (std::optional<ConstOperand> constant = const_operand(bin_expr)) {
+            gen_expr_reg(constant->other, dst);
+            gen_const_op(bin_expr.kind, dst, constant.value());
+            return;
+        }
+        Operands operands = gen_operands_reg(bin_expr, dst);
+        gen_bin_op(bin_expr.kind, dst, operands.lhs, operands.rhs);
+        if (operands.tmp.has_value()) {
+            free_reg(operands.tmp.value());
+        }
+    }
+
+    struct Operands {
+        Reg lhs;
+        Reg rhs;
+        std::optional<Reg> tmp; // allocated for one of them, for the caller to free
+    };
+
+    // Evaluates both sides of `bin_expr`, the one needing more registers first,
+    // the first into `dst`. When both sides can exit or fault, which one does is
+    // visible, so the right goes first as on the stack machine.
+    Operands gen_operands_reg(const FlatNode& bin_expr, Reg dst)
+    {
+        bool lhs_first = m_need[bin_expr.a] >= m_need[bin_expr.b] && !(m_effects[bin_expr.a] && m_effects[bin_expr.b]);
+        uint32_t first = lhs_first ? bin_expr.a : bin_expr.b;
+        uint32_t second = lhs_first ? bin_expr.b : bin_expr.a;
+        gen_expr_reg(first, dst);
+
+        Reg first_reg = dst;
+        Reg second_reg;
+        std::optional<Reg> tmp;
+        const FlatNode& second_node = m_ast.node(second);
+        if (second_node.kind == NodeKind::ident && lookup_var(second_node.a).reg.has_value()) {
+            // read the variable's register in place, nothing clobbers it below
+            second_reg = lookup_var(second_node.a).reg.value();
+        }
+        else if ((tmp = alloc_reg()).has_value()) {
+            gen_expr_reg(second, tmp.value());
+            second_reg = tmp.value();
+        }
+        else {
+            // out of registers: spill the first result and reload it into rax
+            push(reg_op(dst));
+            gen_expr_reg(second, dst);
+            pop(Reg::rax);
+            first_reg = Reg::rax;
+            second_reg = dst;
+        }
+        return {
+            .lhs = lhs_first ? first_reg : second_reg,
+            .rhs = lhs_first ? second_reg : first_reg,
+            .tmp = tmp,
         };
+    }
 
-        ExprVisitor visitor { .gen = *this };
-        std::visit(visitor, expr->var);
+    // dst = lhs <op> rhs. `dst` may alias either operand; operands that are neither
+    // `dst` nor a variable's register may be clobbered.
+    void gen_bin_op(NodeKind kind, Reg dst, Reg lhs, Reg rhs)
+    {
+        switch (kind) {
+        case NodeKind::add:
+        case NodeKind::multi: {
+            Op op = kind == NodeKind::add ? Op::add : Op::imul;
+            Reg other = dst == rhs ? lhs : rhs;
+            mov(dst, reg_op(dst == rhs ? rhs : lhs));
+            emit(op, reg_op(dst), reg_op(other));
+            break;
+        }
+        case NodeKind::sub:
+            if (dst == rhs) {
+                emit(Op::neg, reg_op(dst));
+                emit(Op::add, reg_op(dst), reg_op(lhs));
+            }
+            else {
+                mov(dst, reg_op(lhs));
+                emit(Op::sub, reg_op(dst), reg_op(rhs));
+            }
+            break;
+        case NodeKind::div: {
+            Reg divisor = rhs;
+            if (rhs == Reg::rax) {
+                emit(Op::xchg, reg_op(Reg::rax), reg_op(lhs));
+                divisor = lhs;
+            }
+            else {
+                mov(Reg::rax, reg_op(lhs));
+            }
+            emit(Op::xor_, reg_op(Reg::rdx), reg_op(Reg::rdx));
+            emit(Op::div, reg_op(divisor));
+            mov(dst, reg_op(Reg::rax));
+            break;
+        }
+        case NodeKind::less_than:
+        case NodeKind::greater_than:
+            emit(Op::cmp, reg_op(lhs), reg_op(rhs));
+            gen_set(kind, dst);
+            break;
+        default:
+            assert(false); // Unreachable - only called on binary expressions
+        }
     }
 
-    void gen_scope(const NodeScope* scope)
+    // dst = 1 if the flags of the last cmp say `kind` holds, 0 otherwise
+    void gen_set(NodeKind kind, Reg dst)
     {
-        begin_scope();
-        for (const NodeStmt* stmt : scope->stmts) {
-            gen_stmt(stmt);
+        emit(kind == NodeKind::less_than ? Op::setb : Op::seta, reg_op(dst));
+        emit(Op::movzx, reg_op(dst), reg_op(dst));
+    }
+
+    // -------------------- CONDITIONS ----------------------
+    //
+    // An `if` jumps over its scope when the condition is false. A comparison sets
+    // the flags and branches on them directly, `a < b` skipping on a >= b and
+    // `a > b` on a <= b, rather than materializing 0 or 1 and testing that. The
+    // language is unsigned, so these are the unsigned jumps.
+
+    // Evaluates the condition `expr` and returns the jump that skips when it is false.
+    Op gen_cond(uint32_t expr)
+    {
+        const FlatNode* node = &m_ast.node(expr);
+        while (node->kind == NodeKind::paren) {
+            node = &m_ast.node(node->a);
         }
-        end_scope();
+        if (node->kind == NodeKind::less_than || node->kind == NodeKind::greater_than) {
+            return gen_compare(*node);
+        }
+        Reg cond = Reg::rax;
+        if (m_options.regalloc) {
+            cond = alloc_reg().value();
+            gen_expr_reg(expr, cond);
+            free_reg(cond);
+        }
+        else {
+            gen_expr(expr);
+            pop(Reg::rax);
+        }
+        emit(Op::test, reg_op(cond), reg_op(cond));
+        return Op::jz;
     }
 
-    void gen_stmt(const NodeStmt* stmt)
-    {
-        struct StmtVisitor {
-            Generator& gen;
-            void operator()(const NodeStmtExit* stmt_exit) const
-            {
-                gen.m_output << "    ; generate code for exiting\n";
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    ; exit with code generated above\n";
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-            }
-            void operator()(const NodeStmtLet* stmt_let) const
-            {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_let->ident.value.value();
-                });
-                if (it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-            }
-            void operator()(const NodeScope* scope) const
-            {
-                gen.gen_scope(scope);
-            }
-            void operator()(const NodeStmtIf* stmt_if) const
-            {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                gen.m_output << label << ":\n";
-            }
-            void operator()(const NodeStmtFunction* func) const {
-                // when we pass argument EX into function with value 4
-                // we should push it as if it was a global variable
-                // then as soon as function is done we remove variable
-                gen.m_output << "; generate code for function " << func->ident.value.value() << "\n";
-                gen.m_output << "\n" << gen.create_label() << ":\n";
-                // parameters are backwards (push A, B) -> (B, A) on stack
-                for (int i = func->parameters.size(); i > 0; i--) {
-                    gen.m_vars.push_back({.name=func->parameters.at(i).value.value(), .stack_loc=gen.m_vars.size()});
+    // cmp for the comparison `cmp`, returning the jump taken when it is false
+    Op gen_compare(const FlatNode& cmp)
+    {
+        bool less = cmp.kind == NodeKind::less_than;
+        if (std::optional<ConstOperand> constant = const_operand(cmp)) {
+            Reg other = Reg::rax;
+            const FlatNode& other_node = m_ast.node(constant->other);
+            if (m_options.regalloc && other_node.kind == NodeKind::ident && lookup_var(other_node.a).reg.has_value()) {
+                // cmp only reads, so the variable's register can be compared in place
+                other = lookup_var(other_node.a).reg.value();
+            }
+            else if (m_options.regalloc) {
+                other = alloc_reg().value();
+                gen_expr_reg(constant->other, other);
+                free_reg(other);
+            }
+            else {
+                gen_expr(constant->other);
+                pop(Reg::rax);
+            }
+            gen_imm_arith(Op::cmp, other, static_cast<int64_t>(constant->value));
+            // `value < other` is `other > value`
+            less = less != constant->on_left;
+        }
+        else if (m_options.regalloc) {
+            Reg dst = alloc_reg().value();
+            Operands operands = gen_operands_reg(cmp, dst);
+            emit(Op::cmp, reg_op(operands.lhs), reg_op(operands.rhs));
+            if (operands.tmp.has_value()) {
+                free_reg(operands.tmp.value());
+            }
+            free_reg(dst);
+        }
+        else {
+            gen_expr(cmp.b);
+            gen_expr(cmp.a);
+            pop(Reg::rax);
+            pop(Reg::rbx);
+            emit(Op::cmp, reg_op(Reg::rax), reg_op(Reg::rbx));
+        }
+        return less ? Op::jae : Op::jbe;
+    }
+
+    // -------------------- STRENGTH REDUCTION ----------------------
+    //
+    // A binary expression with an integer literal on one side computes the other
+    // side into a register and applies the constant to it in place: adds,
+    // subtracts and comparisons take it as an immediate, multiplies become shifts, lea or an
+    // immediate imul, and unsigned divides become shifts or a multiply by a fixed
+    // point reciprocal. Only rax and rdx are used as scratch (plus rcx when the
+    // stack machine has the value in rax), which the register allocator never
+    // hands out.
+
+    struct ConstOperand {
+        uint32_t other; // the expression on the other side
+        uint64_t value;
+        bool on_left; // `value <op> other` rather than `other <op> value`
+    };
+
+    // The literal operand of `bin_expr`, looking through parentheses, if one side
+    // is a literal and the operation can be done against it. Dividing a literal,
+    // and dividing by zero, keep the div instruction.
+    std::optional<ConstOperand> const_operand(const FlatNode& bin_expr)
+    {
+        if (!m_options.strength_reduce) {
+            return {};
+        }
+        if (std::optional<uint64_t> rhs = literal_value(bin_expr.b)) {
+            if (bin_expr.kind != NodeKind::div || rhs.value() != 0) {
+                return ConstOperand { .other = bin_expr.a, .value = rhs.value(), .on_left = false };
+            }
+        }
+        if (std::optional<uint64_t> lhs = literal_value(bin_expr.a); lhs.has_value() && bin_expr.kind != NodeKind::div) {
+            return ConstOperand { .other = bin_expr.b, .value = lhs.value(), .on_left = true };
+        }
+        return {};
+    }
+
+    std::optional<uint64_t> literal_value(uint32_t expr)
+    {
+        const FlatNode* node = &m_ast.node(expr);
+        while (node->kind == NodeKind::paren) {
+            node = &m_ast.node(node->a);
+        }
+        if (node->kind != NodeKind::int_lit) {
+            return {};
+        }
+        return static_cast<uint64_t>(int_lit(*node).value);
+    }
+
+    // dst = dst <op> constant, or constant <op> dst if it is on the left
+    void gen_const_op(NodeKind kind, Reg dst, const ConstOperand& constant)
+    {
+        auto imm = static_cast<int64_t>(constant.value);
+        switch (kind) {
+        case NodeKind::add:
+            gen_imm_arith(Op::add, dst, imm);
+            break;
+        case NodeKind::sub:
+            if (constant.on_left) {
+                emit(Op::neg, reg_op(dst));
+                gen_imm_arith(Op::add, dst, imm);
+            }
+            else {
+                gen_imm_arith(Op::sub, dst, imm);
+            }
+            break;
+        case NodeKind::multi:
+            gen_mul_const(dst, constant.value);
+            break;
+        case NodeKind::div:
+            gen_div_const(dst, constant.value);
+            break;
+        case NodeKind::less_than:
+        case NodeKind::greater_than:
+            gen_imm_arith(Op::cmp, dst, imm);
+            // `value < dst` is `dst > value`
+            gen_set(constant.on_left == (kind == NodeKind::less_than) ? NodeKind::greater_than : NodeKind::less_than, dst);
+            break;
+        default:
+            assert(false); // Unreachable - only called on binary expressions
+        }
+    }
+
+    // add/sub/imul/cmp dst, imm, through rdx when the immediate needs more than 32 bits
+    void gen_imm_arith(Op op, Reg dst, int64_t imm)
+    {
+        if (fits_imm32(imm)) {
+            emit(op, reg_op(dst), imm_op(imm));
+        }
+        else {
+            emit(Op::mov, reg_op(Reg::rdx), imm_op(imm));
+            emit(op, reg_op(dst), reg_op(Reg::rdx));
+        }
+    }
+
+    void gen_mul_const(Reg dst, uint64_t value)
+    {
+        if (value == 0) {
+            emit(Op::mov, reg_op(dst), imm_op(0));
+        }
+        else if (std::has_single_bit(value)) {
+            if (value != 1) {
+                emit(Op::shl, reg_op(dst), imm_op(std::countr_zero(value)));
+            }
+        }
+        else if (value == 3 || value == 5 || value == 9) {
+            emit(Op::lea, reg_op(dst), index_op(dst, dst, static_cast<uint8_t>(value - 1)));
+        }
+        else {
+            // the low 64 bits of a product are the same signed or unsigned
+            gen_imm_arith(Op::imul, dst, static_cast<int64_t>(value));
+        }
+    }
+
+    // Unsigned division by a constant other than zero: n / d is the high half of
+    // n * m shifted right, for a 64-bit fixed point reciprocal m of d. When m needs
+    // 65 bits, its top bit is added back in as ((n - hi) >> 1) + hi. The reciprocal
+    // is computed the way libdivide does.
+    void gen_div_const(Reg dst, uint64_t divisor)
+    {
+        if (std::has_single_bit(divisor)) {
+            if (divisor != 1) {
+                emit(Op::shr, reg_op(dst), imm_op(std::countr_zero(divisor)));
+            }
+            return;
+        }
+        int shift = std::bit_width(divisor) - 1;
+        unsigned __int128 dividend = static_cast<unsigned __int128>(1) << (64 + shift);
+        auto magic = static_cast<uint64_t>(dividend / divisor);
+        auto rem = static_cast<uint64_t>(dividend % divisor);
+        bool add = divisor - rem >= (uint64_t(1) << shift);
+        if (add) {
+            // one more bit of precision, carried by the add-back
+            uint64_t twice_rem = rem + rem;
+            magic += magic;
+            if (twice_rem >= divisor || twice_rem < rem) {
+                magic++;
+            }
+        }
+        magic++;
+
+        // The numerator has to survive the multiply, which takes rax and rdx. Only
+        // the stack machine computes into rax; allocated registers never are.
+        Reg numerator = dst;
+        if (add && dst == Reg::rax) {
+            numerator = Reg::rcx;
+            mov(numerator, reg_op(dst));
+        }
+        mov(Reg::rax, reg_op(dst));
+        emit(Op::mov, reg_op(Reg::rdx), imm_op(static_cast<int64_t>(magic)));
+        emit(Op::mul, reg_op(Reg::rdx));
+        if (add) {
+            emit(Op::sub, reg_op(numerator), reg_op(Reg::rdx));
+            emit(Op::shr, reg_op(numerator), imm_op(1));
+            emit(Op::add, reg_op(numerator), reg_op(Reg::rdx));
+            if (shift != 0) {
+                emit(Op::shr, reg_op(numerator), imm_op(shift));
+            }
+            mov(dst, reg_op(numerator));
+        }
+        else {
+            if (shift != 0) {
+                emit(Op::shr, reg_op(Reg::rdx), imm_op(shift));
+            }
+            mov(dst, reg_op(Reg::rdx));
+        }
+    }
+
+    static bool fits_imm32(int64_t value)
+    {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // -------------------- DEAD CODE ----------------------
+    //
+    // m_reachable follows whether control can get to the code being emitted: an
+    // exit or a return ends it, and a label something jumps to brings it back.
+    // Statements nothing reaches are not generated at all. Reads are counted by
+    // name, so a `let` is only dropped when no variable of that name is ever read.
+
+    // whether what is generated next can be left out
+    [[nodiscard]] bool unreachable() const
+    {
+        return m_options.eliminate_dead_code && !m_reachable;
+    }
+
+    [[nodiscard]] bool unused_let(const FlatNode& let) const
+    {
+        // streaming has yet to see the statements that might read a top-level variable
+        return m_options.eliminate_dead_code && m_uses[let.a] == 0 && (m_whole_program || !m_scopes.empty());
+    }
+
+    // Whether evaluating `expr` can be skipped: it makes no calls and divides only
+    // by nonzero constants. Still reports the errors generating it would have.
+    bool pure(uint32_t expr)
+    {
+        const FlatNode& node = m_ast.node(expr);
+        switch (node.kind) {
+        case NodeKind::int_lit:
+            int_lit(node);
+            return true;
+        case NodeKind::ident:
+            lookup_var(node.a);
+            return true;
+        case NodeKind::paren:
+            return pure(node.a);
+        case NodeKind::call:
+            return false;
+        case NodeKind::div: {
+            std::optional<uint64_t> divisor = constant(node.b);
+            return pure(node.a) && divisor.has_value() && divisor.value() != 0;
+        }
+        default:
+            return pure(node.a) && pure(node.b);
+        }
+    }
+
+    // the value of `expr` if it is a literal
+    std::optional<uint64_t> constant(uint32_t expr)
+    {
+        const FlatNode& node = m_ast.node(expr);
+        if (node.kind == NodeKind::paren) {
+            return constant(node.a);
+        }
+        if (node.kind != NodeKind::int_lit) {
+            return {};
+        }
+        return static_cast<uint64_t>(int_lit(node).value);
+    }
+
+    // -------------------- FUNCTIONS ----------------------
+    //
+    // Functions follow the System V calling convention for integers: up to six
+    // arguments in rdi, rsi, rdx, rcx, r8 and r9, the result in rax, and rbx and
+    // r12-r15 preserved. Nothing outside the program is ever called, so the stack
+    // is not kept 16-byte aligned. A body sees only its parameters and locals, and
+    // its code is kept with its Function, to be written after the program.
+    //
+    // There is no frame pointer: locals are addressed from rsp like everywhere
+    // else. Leaf functions take caller-saved registers first, so most need no
+    // prologue at all, and keep their arguments where they arrived. Functions that
+    // make calls move their arguments into callee-saved registers, which survive
+    // the calls, and every call site pushes whatever caller-saved registers are live.
+    //
+    // The CallGraph picks the functions worth inlining. Their calls become a copy
+    // of the body that takes its parameters straight from the argument
+    // expressions and leaves its result where the call's would have gone, so
+    // nothing around it has to be saved.
+
+    static constexpr Reg arg_regs[] = { Reg::rdi, Reg::rsi, Reg::rdx, Reg::rcx, Reg::r8, Reg::r9 };
+    static constexpr Reg callee_saved_regs[] = { Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+    static constexpr Reg leaf_alloc_regs[] = {
+        Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10,
+        Reg::r11, Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15,
+    };
+    static constexpr Reg caller_alloc_regs[] = {
+        Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rcx,
+        Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r11,
+    };
+
+    struct Function {
+        uint32_t label;
+        size_t arity;
+        bool defined = false;
+        std::string name; // for errors once the AST it came from is gone
+        std::optional<uint32_t> deferred {}; // definition gen_prog has yet to generate
+        Assembly code {};
+        std::vector<uint32_t> calls {}; // string ids of the functions its code calls
+        bool reachable = false;
+    };
+
+    // where `return` goes: the epilogue of a function, or the end of an inlined body
+    struct Return {
+        uint32_t label;
+        size_t stack_base; // m_stack_size where the body's stack starts
+        std::optional<Reg> reg {}; // result of an inlined body with register allocation; rax otherwise
+        bool taken = false; // some return jumps to the label
+    };
+
+    static constexpr size_t max_inline_depth = 16;
+
+    // The function named `name`, called or defined with `arity` arguments. Calls
+    // may come before the definition, so the first use creates it.
+    Function& function(uint32_t name, size_t arity)
+    {
+        if (arity > std::size(arg_regs)) {
+            compile_error("Functions take at most ", std::size(arg_regs), " arguments: ", m_ast.str(name));
+        }
+        auto it = m_functions.find(name);
+        if (it == m_functions.end()) {
+            Function function { .label = create_label(), .arity = arity, .name = std::string(m_ast.str(name)) };
+            it = m_functions.emplace(name, std::move(function)).first;
+        }
+        if (it->second.arity != arity) {
+            compile_error("Wrong number of arguments for function: ", m_ast.str(name));
+        }
+        return it->second;
+    }
+
+    void define_function(uint32_t stmt)
+    {
+        const FlatNode& func = m_ast.node(stmt);
+        Function& info = function(func.a, m_ast.function_params(func).size());
+        if (info.defined) {
+            compile_error("Function already defined: ", m_ast.str(func.a));
+        }
+        info.defined = true;
+        m_definition_order.push_back(func.a);
+        if (m_whole_program) {
+            info.deferred = stmt;
+        }
+        else {
+            gen_function(info, func);
+        }
+    }
+
+    // Generates the bodies gen_prog set aside: first every one the program can
+    // call, with inlining, then the rest, only to report their errors, without.
+    void gen_deferred_functions()
+    {
+        std::vector<uint32_t> pending = m_main_calls;
+        for (size_t i = 0; i < pending.size(); i++) {
+            Function& info = m_functions.at(pending[i]);
+            if (info.deferred.has_value()) {
+                gen_function(info, m_ast.node(std::exchange(info.deferred, {}).value()));
+                pending.insert(pending.end(), info.calls.begin(), info.calls.end());
+            }
+        }
+        m_call_graph.reset();
+        for (uint32_t name : m_definition_order) {
+            Function& info = m_functions.at(name);
+            if (info.deferred.has_value()) {
+                gen_function(info, m_ast.node(std::exchange(info.deferred, {}).value()));
+            }
+        }
+    }
+
+    void mark_reachable()
+    {
+        std::vector<uint32_t> pending = m_main_calls;
+        while (!pending.empty()) {
+            Function& info = m_functions.at(pending.back());
+            pending.pop_back();
+            if (!info.reachable) {
+                info.reachable = true;
+                pending.insert(pending.end(), info.calls.begin(), info.calls.end());
+            }
+        }
+    }
+
+    void gen_function(Function& info, const FlatNode& func)
+    {
+        std::span<const uint32_t> params = m_ast.function_params(func);
+
+        // start from nothing: no variables, registers or stack of the code around it
+        Assembly outer_code = std::exchange(m_assembly, {});
+        size_t outer_visible = std::exchange(m_visible_vars, m_vars.size());
+        size_t outer_stack_size = std::exchange(m_stack_size, 0);
+        uint32_t outer_busy_regs = std::exchange(m_busy_regs, 0);
+        std::span<const Reg> outer_alloc_order = m_alloc_order;
+        std::optional<Return> outer_return = std::exchange(m_return, Return { .label = create_label(), .stack_base = 0 });
+        std::vector<uint32_t>* outer_calls = std::exchange(m_calls, &info.calls);
+        bool outer_reachable = std::exchange(m_reachable, true);
+        bool leaf = !m_options.regalloc || !makes_calls(m_ast.function_scope(func));
+        m_alloc_order = leaf ? std::span<const Reg>(leaf_alloc_regs) : std::span<const Reg>(caller_alloc_regs);
+
+        comment("function ", m_ast.str(func.a));
+        emit(Op::label, label_op(info.label));
+        size_t entry = m_assembly.instrs.size();
+        begin_scope();
+        if (m_options.regalloc) {
+            for (size_t i = 0; i < params.size(); i++) {
+                if (arg_regs[i] != Reg::rdx) {
+                    m_busy_regs |= reg_bit(arg_regs[i]);
                 }
-                gen.gen_scope(func->scope);
-                gen.m_output << "    ; pop " << func->parameters.size() << " arguments off of stack\n";
-                for (int i = 0; i < func->parameters.size(); i++) {
-                    gen.pop("rax");
+            }
+        }
+        for (size_t i = 0; i < params.size(); i++) {
+            if (find_var(params[i]) != nullptr) {
+                compile_error("Parameter already used: ", m_ast.str(params[i]));
+            }
+            Reg arg = arg_regs[i];
+            if (!m_options.regalloc) {
+                declare({ .name = params[i], .stack_loc = m_stack_size });
+                push(reg_op(arg));
+            }
+            else if (leaf && arg != Reg::rdx) {
+                declare({ .name = params[i], .stack_loc = 0, .reg = arg });
+            }
+            else {
+                // rdx is scratch for div and large immediates
+                Reg reg = alloc_reg().value();
+                mov(reg, reg_op(arg));
+                if (arg != Reg::rdx) {
+                    free_reg(arg);
                 }
+                declare({ .name = params[i], .stack_loc = 0, .reg = reg });
             }
-        };
+        }
+        gen_scope(m_ast.function_scope(func));
+        end_scope();
+        if (!unreachable()) {
+            comment("return 0 when the body ends without a return");
+            emit(Op::mov, reg_op(Reg::rax), imm_op(0));
+        }
+        emit(Op::label, label_op(m_return->label));
+        emit(Op::ret);
+        save_callee_saved(entry);
+
+        info.code = std::exchange(m_assembly, std::move(outer_code));
+        m_visible_vars = outer_visible;
+        m_stack_size = outer_stack_size;
+        m_busy_regs = outer_busy_regs;
+        m_alloc_order = outer_alloc_order;
+        m_return = outer_return;
+        m_calls = outer_calls;
+        m_reachable = outer_reachable;
+    }
+
+    // Pushes the callee-saved registers the function just generated writes to at
+    // `entry`, and pops them again before its ret. Everything in between addresses
+    // the stack from rsp and never reaches as far up as the saved registers.
+    void save_callee_saved(size_t entry)
+    {
+        std::vector<Instr>& instrs = m_assembly.instrs;
+        std::vector<Instr> saves;
+        std::vector<Instr> restores;
+        for (Reg reg : callee_saved_regs) {
+            bool written = std::any_of(instrs.begin() + static_cast<ptrdiff_t>(entry), instrs.end(), [&](const Instr& instr) {
+                return writes(instr, reg);
+            });
+            if (written) {
+                saves.push_back({ .op = Op::push, .dst = reg_op(reg) });
+                restores.insert(restores.begin(), { .op = Op::pop, .dst = reg_op(reg) });
+            }
+        }
+        if (saves.empty()) {
+            return;
+        }
+        instrs.insert(instrs.end() - 1, restores.begin(), restores.end());
+        instrs.insert(instrs.begin() + static_cast<ptrdiff_t>(entry), saves.begin(), saves.end());
+    }
 
-        StmtVisitor visitor { .gen = *this };
-        std::visit(visitor, stmt->var);
+    static bool writes(const Instr& instr, Reg reg)
+    {
+        switch (instr.op) {
+        case Op::push:
+        case Op::test:
+        case Op::cmp:
+        case Op::mul:
+        case Op::div:
+            return false;
+        case Op::xchg:
+            return instr.dst.is_reg(reg) || instr.src.is_reg(reg);
+        default:
+            return instr.dst.is_reg(reg);
+        }
     }
 
-    [[nodiscard]] std::string gen_prog()
+    // whether `node` leads to a call instruction, not counting the bodies of nested
+    // definitions: a call that gets inlined only does if the inlined body does
+    [[nodiscard]] bool makes_calls(uint32_t index) const
     {
-        m_output << ";=-------------------------------------------------=\n";
-        m_output << ";|                   DUMB ASSEMBLY                 |\n";
-        m_output << ";| If you encounter an issue, report it on GitHub! |\n";
-        m_output << ";=-------------------------------------------------=\n";
-        m_output << "global _start\n_start:\n";
+        const FlatNode& node = m_ast.node(index);
+        switch (node.kind) {
+        case NodeKind::call:
+            if (!m_call_graph.has_value() || !m_call_graph->inline_calls_to(node.a) || m_call_graph->makes_calls(node.a)) {
+                return true;
+            }
+            return std::any_of(m_ast.call_args(node).begin(), m_ast.call_args(node).end(), [&](uint32_t arg) { return makes_calls(arg); });
+        case NodeKind::int_lit:
+        case NodeKind::ident:
+        case NodeKind::function:
+            return false;
+        case NodeKind::paren:
+        case NodeKind::exit:
+        case NodeKind::return_:
+            return makes_calls(node.a);
+        case NodeKind::let:
+            return makes_calls(node.b);
+        case NodeKind::scope:
+        case NodeKind::prog:
+            return std::any_of(m_ast.stmts(node).begin(), m_ast.stmts(node).end(), [&](uint32_t stmt) { return makes_calls(stmt); });
+        default:
+            // binary expressions and if
+            return makes_calls(node.a) || makes_calls(node.b);
+        }
+    }
 
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+    // dst = the result of `call`. The arguments go through the stack on their way
+    // to their registers, as evaluating one may clobber the registers of others.
+    void gen_call_reg(const FlatNode& call, Reg dst)
+    {
+        std::span<const uint32_t> args = m_ast.call_args(call);
+        uint32_t label = function(call.a, args.size()).label;
+        if (std::optional<uint32_t> func = inline_definition(call)) {
+            gen_inline_call(call, m_ast.node(func.value()), dst);
+            return;
         }
+        comment("call ", m_ast.str(call.a));
+        std::vector<Reg> saved;
+        for (Reg reg : alloc_regs) {
+            bool callee_saved = std::find(std::begin(callee_saved_regs), std::end(callee_saved_regs), reg) != std::end(callee_saved_regs);
+            if (m_busy_regs & reg_bit(reg) && reg != dst && !callee_saved) {
+                push(reg_op(reg));
+                saved.push_back(reg);
+            }
+        }
+        for (uint32_t arg : args) {
+            gen_expr_reg(arg, dst);
+            push(reg_op(dst));
+        }
+        for (size_t i = args.size(); i > 0; i--) {
+            pop(arg_regs[i - 1]);
+        }
+        emit(Op::call, label_op(label));
+        m_calls->push_back(call.a);
+        mov(dst, reg_op(Reg::rax));
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            pop(*it);
+        }
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+    // The definition to expand `call` into, when it is to be inlined here. Inlining
+    // stops after a few levels, and with register allocation when too few
+    // registers are free for the body, which then gets a real call.
+    [[nodiscard]] std::optional<uint32_t> inline_definition(const FlatNode& call) const
+    {
+        if (!m_call_graph.has_value() || !m_call_graph->inline_calls_to(call.a) || m_inline_depth == max_inline_depth
+            || (m_options.regalloc && free_reg_count() <= regs_kept_for_exprs)) {
+            return {};
+        }
+        std::optional<uint32_t> func = m_call_graph->definition(call.a);
+        if (m_ast.function_params(m_ast.node(func.value())).size() != m_ast.call_args(call).size()) {
+            return {}; // reported by the definition
+        }
+        return func;
     }
 
-private:
-    void push(const std::string& reg)
+    // Expands `call` into a copy of the body of `func`. Each argument is evaluated
+    // into its parameter's register, or stack slot when registers run short, and
+    // a return jumps to the end with the result in `dst`, or pushed without
+    // register allocation, just like an ordinary call leaves it.
+    void gen_inline_call(const FlatNode& call, const FlatNode& func, std::optional<Reg> dst)
     {
-        m_output << "    push " << reg << "\n";
+        std::span<const uint32_t> args = m_ast.call_args(call);
+        std::span<const uint32_t> params = m_ast.function_params(func);
+        comment("inline call to ", m_ast.str(call.a));
+        size_t stack_base = m_stack_size;
+        std::vector<Var> bound;
+        for (size_t i = 0; i < args.size(); i++) {
+            std::optional<Reg> reg;
+            if (m_options.regalloc && free_reg_count() > regs_kept_for_exprs) {
+                reg = alloc_reg();
+            }
+            if (reg.has_value()) {
+                gen_expr_reg(args[i], reg.value());
+            }
+            else if (m_options.regalloc) {
+                gen_expr_reg(args[i], dst.value());
+                push(reg_op(dst.value()));
+            }
+            else {
+                gen_expr(args[i]);
+            }
+            bound.push_back({ .name = params[i], .stack_loc = reg.has_value() ? 0 : m_stack_size - 1, .reg = reg });
+        }
+
+        // like a real call, the body sees none of the caller's variables
+        size_t outer_visible = std::exchange(m_visible_vars, m_vars.size());
+        std::optional<Return> outer_return = std::exchange(m_return, Return { .label = create_label(), .stack_base = stack_base, .reg = dst });
+        m_inline_depth++;
+        begin_scope();
+        for (const Var& var : bound) {
+            declare(var);
+        }
+        gen_scope(m_ast.function_scope(func));
+        end_scope();
+        if (!unreachable()) {
+            comment("0 when the body ends without a return");
+            emit(Op::mov, reg_op(dst.value_or(Reg::rax)), imm_op(0));
+        }
+        m_reachable = m_reachable || m_return->taken;
+        emit(Op::label, label_op(m_return->label));
+        if (!m_options.regalloc) {
+            push(reg_op(Reg::rax));
+        }
+        m_inline_depth--;
+        m_return = outer_return;
+        m_visible_vars = outer_visible;
+    }
+
+    // -------------------- SYMBOL TABLE ----------------------
+    //
+    // Names are dense string ids, so the innermost binding of every name is kept in
+    // a vector indexed by id and lookups are a single load. A declaration remembers
+    // the binding it hides, which end_scope puts back. Inside a function, bindings
+    // below m_visible_vars belong to the code around it and are not found.
+
+    void declare(Var var)
+    {
+        if (var.name >= m_bindings.size()) {
+            m_bindings.resize(m_ast.string_offsets.size(), no_var);
+        }
+        var.shadowed = m_bindings[var.name];
+        m_bindings[var.name] = static_cast<uint32_t>(m_vars.size());
+        m_vars.push_back(var);
+    }
+
+    [[nodiscard]] const Var* find_var(uint32_t name) const
+    {
+        if (name >= m_bindings.size() || m_bindings[name] == no_var || m_bindings[name] < m_visible_vars) {
+            return nullptr;
+        }
+        return &m_vars[m_bindings[name]];
+    }
+
+    const Var& lookup_var(uint32_t name)
+    {
+        const Var* var = find_var(name);
+        if (var == nullptr) {
+            compile_error("Undeclared identifier: ", m_ast.str(name));
+        }
+        return *var;
+    }
+
+    // where a variable currently lives: its register, or its stack slot
+    [[nodiscard]] Operand var_op(const Var& var) const
+    {
+        if (var.reg.has_value()) {
+            return reg_op(var.reg.value());
+        }
+        return mem_op(Reg::rsp, static_cast<int64_t>((m_stack_size - var.stack_loc - 1) * 8));
+    }
+
+    Operand int_lit(const FlatNode& node)
+    {
+        std::string_view text = m_ast.str(node.a);
+        uint64_t value;
+        auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (err != std::errc() || end != text.data() + text.size()) {
+            compile_error("Integer literal does not fit in 64 bits: ", text);
+        }
+        return imm_op(static_cast<int64_t>(value));
+    }
+
+    void emit(Op op, Operand dst = {}, Operand src = {})
+    {
+        m_assembly.instrs.push_back({ .op = op, .dst = dst, .src = src });
+    }
+
+    template <typename... Parts>
+    void comment(const Parts&... parts)
+    {
+        std::stringstream text;
+        (text << ... << parts);
+        emit(Op::comment, imm_op(static_cast<int64_t>(m_assembly.comments.size())));
+        m_assembly.comments.push_back(text.str());
+    }
+
+    void push(const Operand& operand)
+    {
+        emit(Op::push, operand);
         m_stack_size++;
     }
 
-    void pop(const std::string& reg)
+    void pop(Reg reg)
     {
-        m_output << "    pop " << reg << "\n";
+        emit(Op::pop, reg_op(reg));
         m_stack_size--;
     }
 
@@ -219,31 +1446,58 @@ private:
 
     void end_scope()
     {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+        size_t pop_count = 0;
+        for (size_t i = m_vars.size(); i > m_scopes.back(); i--) {
+            const Var& var = m_vars[i - 1];
+            if (var.reg.has_value()) {
+                free_reg(var.reg.value());
+            }
+            else if (!var.dropped) {
+                pop_count++;
+            }
+            m_bindings[var.name] = var.shadowed;
         }
+        if (!unreachable() && (pop_count != 0 || !m_options.eliminate_dead_code)) {
+            emit(Op::add, reg_op(Reg::rsp), imm_op(static_cast<int64_t>(pop_count * 8)));
+        }
+        m_stack_size -= pop_count;
+        m_vars.resize(m_scopes.back());
         m_scopes.pop_back();
     }
 
-    std::string create_label()
+    uint32_t create_label()
     {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+        return m_label_count++;
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    const NodeProg m_prog;
-    std::stringstream m_output;
+    FlatAstView m_ast {};
+    const GeneratorOptions m_options;
+    OutputSink* m_out = nullptr;
+    Encoder* m_encoder = nullptr;
+    Profiler* m_profiler = nullptr;
+    Assembly m_assembly;
+    PeepholeStats m_peephole_stats {};
     size_t m_stack_size = 0;
     std::vector<Var> m_vars {};
+    std::vector<uint32_t> m_bindings {}; // innermost entry in m_vars for each string id
+    size_t m_visible_vars = 0; // entries below this belong to the code around a function
     std::vector<size_t> m_scopes {};
-    int m_label_count = 0;
-};
\ No newline at end of file
+    uint32_t m_label_count = 0;
+
+    std::vector<uint8_t> m_need; // Sethi-Ullman number of every node
+    std::vector<bool> m_effects; // whether evaluating a node can exit or fault
+    std::vector<uint32_t> m_uses; // how often each name is read, by string id
+    std::unordered_map<uint32_t, Reg> m_let_regs; // let statement -> register it was given
+    uint32_t m_busy_regs = 0; // bit n set when the register encoded as n is taken
+    std::span<const Reg> m_alloc_order { alloc_regs }; // the order alloc_reg hands registers out in
+
+    std::unordered_map<uint32_t, Function> m_functions; // by string id of the name
+    std::vector<uint32_t> m_definition_order; // names of the defined functions, in the order they were defined
+    std::vector<uint32_t> m_main_calls; // string ids of the functions the top-level code calls
+    std::vector<uint32_t>* m_calls = &m_main_calls; // where the calls of the code being generated go
+    std::optional<Return> m_return; // where `return` goes in the body being generated
+    std::optional<CallGraph> m_call_graph; // set by gen_prog when inlining
+    bool m_reachable = true; // whether control can get to the code being emitted
+    bool m_whole_program = false; // gen_prog: function bodies wait for end_prog, and every read of a name is counted
+    size_t m_inline_depth = 0;
+};
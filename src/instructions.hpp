@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./output.hpp"
+
+// In-memory form of the code Generator emits. Passes rewrite it before it is
+// rendered as NASM text.
+
+// in x86-64 encoding order
+enum class Reg : uint8_t {
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15,
+};
+
+inline const char* reg_name(Reg reg)
+{
+    static constexpr const char* names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    return names[static_cast<int>(reg)];
+}
+
+// the low byte of `reg`, which setcc writes
+inline const char* reg_name8(Reg reg)
+{
+    static constexpr const char* names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+    };
+    return names[static_cast<int>(reg)];
+}
+
+enum class Op : uint8_t {
+    nop, // left behind by passes, never rendered
+    label, // dst: label
+    comment, // dst.value: index into Assembly::comments
+    mov,
+    push,
+    pop,
+    add,
+    sub,
+    imul, // dst *= src, with a register or an immediate
+    mul,
+    div,
+    neg,
+    shl,
+    shr,
+    lea,
+    xor_,
+    xchg,
+    test,
+    cmp,
+    jz,
+    jae, // unsigned >=
+    jbe, // unsigned <=
+    jmp,
+    call, // dst: label
+    ret,
+    syscall,
+    setb, // low byte of dst = unsigned <
+    seta, // low byte of dst = unsigned >
+    movzx, // dst = low byte of src
+};
+
+inline const char* op_name(Op op)
+{
+    static constexpr const char* names[] = {
+        "nop", "label", "comment", "mov", "push", "pop", "add", "sub", "imul",
+        "mul", "div", "neg", "shl", "shr", "lea", "xor", "xchg", "test", "cmp", "jz", "jae", "jbe", "jmp", "call", "ret",
+        "syscall", "setb", "seta", "movzx",
+    };
+    return names[static_cast<int>(op)];
+}
+
+struct Operand {
+    enum class Kind : uint8_t {
+        none,
+        reg,
+        imm,
+        mem, // QWORD [reg + index * scale + value]
+        label,
+    };
+
+    Kind kind = Kind::none;
+    Reg reg = Reg::rax; // the register, or the base of a memory operand
+    int64_t value = 0; // immediate, displacement, label id or comment id
+    Reg index = Reg::rax; // index register of a memory operand, if scale is set
+    uint8_t scale = 0; // 1, 2, 4 or 8, or 0 for no index
+
+    bool operator==(const Operand& other) const = default;
+
+    [[nodiscard]] inline bool is_reg(Reg r) const
+    {
+        return kind == Kind::reg && reg == r;
+    }
+};
+
+inline Operand reg_op(Reg reg)
+{
+    return { .kind = Operand::Kind::reg, .reg = reg };
+}
+
+inline Operand imm_op(int64_t value)
+{
+    return { .kind = Operand::Kind::imm, .value = value };
+}
+
+inline Operand mem_op(Reg base, int64_t disp)
+{
+    return { .kind = Operand::Kind::mem, .reg = base, .value = disp };
+}
+
+// [base + index * scale + disp], for lea
+inline Operand index_op(Reg base, Reg index, uint8_t scale, int64_t disp = 0)
+{
+    return { .kind = Operand::Kind::mem, .reg = base, .value = disp, .index = index, .scale = scale };
+}
+
+inline Operand label_op(uint32_t label)
+{
+    return { .kind = Operand::Kind::label, .value = label };
+}
+
+struct Instr {
+    Op op;
+    Operand dst {};
+    Operand src {};
+};
+
+struct Assembly {
+    std::vector<Instr> instrs;
+    std::vector<std::string> comments;
+};
+
+// `sized` prefixes memory operands with their size, which lea's address has none of
+inline void render_operand(OutputSink& out, const Operand& operand, bool sized = true)
+{
+    switch (operand.kind) {
+    case Operand::Kind::reg:
+        out << reg_name(operand.reg);
+        break;
+    case Operand::Kind::imm:
+        out << operand.value;
+        break;
+    case Operand::Kind::mem:
+        out << (sized ? "QWORD [" : "[") << reg_name(operand.reg);
+        if (operand.scale != 0) {
+            out << " + " << reg_name(operand.index) << "*" << static_cast<int64_t>(operand.scale);
+        }
+        out << " + " << operand.value << "]";
+        break;
+    case Operand::Kind::label:
+        out << "label" << operand.value;
+        break;
+    case Operand::Kind::none:
+        break;
+    }
+}
+
+// banner and entry point that start every program
+inline void render_nasm_header(OutputSink& out)
+{
+    out << ";=-------------------------------------------------=\n";
+    out << ";|                   DUMB ASSEMBLY                 |\n";
+    out << ";| If you encounter an issue, report it on GitHub! |\n";
+    out << ";=-------------------------------------------------=\n";
+    out << "global _start\n_start:\n";
+}
+
+// the instructions of `assembly`, one per line
+inline void render_nasm_instrs(const Assembly& assembly, OutputSink& out)
+{
+    for (const Instr& instr : assembly.instrs) {
+        switch (instr.op) {
+        case Op::nop:
+            break;
+        case Op::label:
+            render_operand(out, instr.dst);
+            out << ":\n";
+            break;
+        case Op::comment:
+            out << "    ; " << assembly.comments[instr.dst.value] << "\n";
+            break;
+        case Op::setb:
+        case Op::seta:
+            out << "    " << op_name(instr.op) << " " << reg_name8(instr.dst.reg) << "\n";
+            break;
+        case Op::movzx:
+            out << "    movzx " << reg_name(instr.dst.reg) << ", " << reg_name8(instr.src.reg) << "\n";
+            break;
+        default:
+            out << "    " << op_name(instr.op);
+            if (instr.dst.kind != Operand::Kind::none) {
+                out << " ";
+                render_operand(out, instr.dst);
+            }
+            if (instr.src.kind != Operand::Kind::none) {
+                out << ", ";
+                render_operand(out, instr.src, instr.op != Op::lea);
+            }
+            out << "\n";
+        }
+    }
+}
\ No newline at end of file
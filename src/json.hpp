@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "./output.hpp"
+
+// Writes JSON straight into an OutputSink, one token at a time. It keeps track of
+// where commas go, so callers just open containers, name keys and write values.
+// With `pretty`, every member and element goes on a line of its own, indented two
+// spaces per level.
+class JsonWriter {
+public:
+    inline JsonWriter(OutputSink& out, bool pretty = false)
+        : m_out(out)
+        , m_pretty(pretty)
+    {
+    }
+
+    inline void begin_object()
+    {
+        open('{');
+    }
+
+    inline void end_object()
+    {
+        close('}');
+    }
+
+    inline void begin_array()
+    {
+        open('[');
+    }
+
+    inline void end_array()
+    {
+        close(']');
+    }
+
+    // the next value written is this member's
+    inline void key(std::string_view name)
+    {
+        separate();
+        write_string(name);
+        m_out << (m_pretty ? ": " : ":");
+        m_after_key = true;
+    }
+
+    inline void string(std::string_view value)
+    {
+        separate();
+        write_string(value);
+    }
+
+    inline void number(int64_t value)
+    {
+        separate();
+        m_out << value;
+    }
+
+    // An unsigned integer of any size, written from its decimal `digits`. JSON
+    // doesn't allow leading zeros, so they are dropped.
+    inline void integer(std::string_view digits)
+    {
+        separate();
+        size_t first = digits.find_first_not_of('0');
+        m_out << (first == std::string_view::npos ? "0" : digits.substr(first));
+    }
+
+    // ends the document with a newline
+    inline void finish()
+    {
+        m_out << "\n";
+    }
+
+private:
+    inline void open(char bracket)
+    {
+        separate();
+        m_out << std::string_view(&bracket, 1);
+        m_depth++;
+        m_first = true;
+    }
+
+    inline void close(char bracket)
+    {
+        m_depth--;
+        if (!m_first) {
+            newline();
+        }
+        m_out << std::string_view(&bracket, 1);
+        m_first = false;
+    }
+
+    // a comma before every value but the first in its container, and for pretty
+    // output a line break; a value right after its key goes on the key's line
+    inline void separate()
+    {
+        if (m_after_key) {
+            m_after_key = false;
+            return;
+        }
+        if (!m_first) {
+            m_out << ",";
+        }
+        m_first = false;
+        if (m_depth > 0) {
+            newline();
+        }
+    }
+
+    inline void newline()
+    {
+        if (!m_pretty) {
+            return;
+        }
+        m_out << "\n";
+        for (int i = 0; i < m_depth; i++) {
+            m_out << "  ";
+        }
+    }
+
+    inline void write_string(std::string_view text)
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        m_out << "\"";
+        size_t plain = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            auto c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            m_out << text.substr(plain, i - plain);
+            if (c == '"' || c == '\\') {
+                char escaped[2] = { '\\', static_cast<char>(c) };
+                m_out << std::string_view(escaped, 2);
+            }
+            else {
+                char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                m_out << std::string_view(escaped, 6);
+            }
+            plain = i + 1;
+        }
+        m_out << text.substr(plain);
+        m_out << "\"";
+    }
+
+    OutputSink& m_out;
+    bool m_pretty;
+    int m_depth = 0;
+    bool m_first = true;
+    bool m_after_key = false;
+};
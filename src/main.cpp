@@ -1,73 +1,365 @@
+#include <charconv>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <sstream>
 #include <vector>
 #include <string>
+#include <unordered_set>
 
-#include "./generation.hpp"
+#include "./ast_file.hpp"
+#include "./cache.hpp"
+#include "./driver.hpp"
 
-int main(int argc, char* argv[])
+// Part of every cache key, so a rebuilt compiler never reuses an older one's output:
+// a hash of the running binary, which stays the same across identical builds.
+// Empty if the binary can't be read, in which case nothing is cached.
+std::optional<uint64_t> compiler_build()
 {
-    if (std::string(argv[1]) =="--help" || argc < 2) {
+    SourceFile self("/proc/self/exe");
+    if (!self.ok()) {
+        return {};
+    }
+    return hash_bytes(self.view());
+}
+
+// true if any argument after the input file is `short_name` or `long_name`
+bool has_flag(int argc, char* argv[], const std::string& short_name, const std::string& long_name)
+{
+    for (int i = 2; i < argc; i++) {
+        if (argv[i] == short_name || argv[i] == long_name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// value of a `--name=value` argument after the input file
+std::optional<std::string> flag_value(int argc, char* argv[], const std::string& name)
+{
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with(name + "=")) {
+            return arg.substr(name.size() + 1);
+        }
+    }
+    return {};
+}
+
+int run(int argc, char* argv[])
+{
+    if (argc < 2 || std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h") {
         std::cout << "=-----------------------------------------=" << std::endl;
         std::cout << "|              DUMB Help Menu             |" << std::endl;
         std::cout << "| A dumb language for dumber programmers. |" << std::endl;
         std::cout << "=-----------------------------------------=" << std::endl;
         std::cout << "\033[0;32m-tk \033[0;mor \033[0;32m--tokenization \033[0;m- Tokenizes the file and pretty prints it to the console." << std::endl;
-        std::cout << "\033[0;32m-ast \033[0;mor \033[0;32m--syntax-tree \033[0;m- Tokenize and parse the file, then pretty print the AST to the console." << std::endl;
+        std::cout << "\033[0;32m-ast \033[0;mor \033[0;32m--syntax-tree \033[0;m- Tokenize and parse the file, then print the AST to the console as JSON. Add \033[0;32m--pretty \033[0;mto indent it." << std::endl;
+        std::cout << "\033[0;32m-bast \033[0;mor \033[0;32m--binary-syntax-tree \033[0;m- Tokenize, parse and constant fold the file (unless \033[0;32m-O0\033[0;m), then save the AST as 'out.ast', a binary file tools can map into memory and use as is. Passing an .ast file instead of source to any mode skips straight to its tree." << std::endl;
         std::cout << "\033[0;31m-asm \033[0;mor \033[0;31m--assembly \033[0;mor \033[0;31m--no-link \033[0;m- Tokenizes, parses, and compiles the file into assembly, as 'out.asm', without linking the file into an executable. NOTE: This is the default behavior when if mo flags are passed in." << std::endl;
         std::cout << "\033[0;31m-h \033[0;mor \033[0;31m--help \033[0;m- Shows this help menu. NOTE: This is the default if no arguments are passed in." << std::endl;
-        std::cout << "\033[0;32m-a \033[0;mor \033[0;32m--all \033[0;m- Tokenizes, parses, compiles, and links the file into a Linux executable. NOTE: This file does need to be 'chmod'ed. However, if you can't run it, run: \033[0;1m $ chmod +x ./out" << std::endl;
+        std::cout << "\033[0;32m-a \033[0;mor \033[0;32m--all \033[0;m- Tokenizes, parses, compiles, and links the file into a Linux executable, './out', using the built-in assembler. NASM and ld are not needed." << std::endl;
+        std::cout << "\033[0;32m--nasm \033[0;m- With \033[0;32m-a\033[0;m, assembles 'out.asm' with NASM and links it with ld instead, to cross-check the built-in assembler. NOTE: This file does need to be 'chmod'ed. However, if you can't run it, run: \033[0;1m $ chmod +x ./out" << std::endl;
+        std::cout << "\033[0;32m-ra \033[0;mor \033[0;32m--regalloc \033[0;m- Keeps temporaries and the most used variables in registers instead of on the stack. Can be combined with any of the above." << std::endl;
+        std::cout << "\033[0;32m-O0 \033[0;mor \033[0;32m--no-optimize \033[0;m- Skips constant folding and the other optimizations and compiles the program as written." << std::endl;
+        std::cout << "\033[0;32m--no-peephole \033[0;mor \033[0;32m--no-peephole=rule,... \033[0;m- Turns off all peephole rules, or just the listed ones (push-pop, dead-move, self-move, zero-stack-adjust, jump-to-next)." << std::endl;
+        std::cout << "\033[0;32m--no-inline \033[0;mor \033[0;32m--inline-limit=N \033[0;m- Turns off inlining, or changes the size of the largest function, in syntax tree nodes, inlined at every call (32 by default). Functions called from a single place are inlined whatever their size. Functions nothing calls are left out of the output either way, unless \033[0;32m-O0\033[0;m." << std::endl;
+        std::cout << "\033[0;32m--peephole-report \033[0;m- Prints how many instructions each peephole rule removed." << std::endl;
+        std::cout << "\033[0;32m--time-report \033[0;m- Prints the wall and CPU time of every phase, how many tokens, nodes and bytes each produced, arena use and peak memory." << std::endl;
+        std::cout << "\033[0;32m--trace=FILE \033[0;m- Writes the phase timings to FILE as Chrome trace_event JSON, for chrome://tracing or Perfetto." << std::endl;
+        std::cout << "\033[0;32m--stream \033[0;m- Compiles and writes out each top-level statement as soon as it is parsed, so memory use depends on the largest statement rather than the whole file. Optimizations do not look across statements." << std::endl;
+        std::cout << "\033[0;32m--cache \033[0;mor \033[0;32m--cache-dir=DIR \033[0;m- Reuses the outputs of an earlier compile of the same source with the same flags, if there is one, and saves them otherwise. The cache lives in DIR, or ~/.cache/dum by default." << std::endl;
+        std::cout << "\033[0;32m--cache-size=MB \033[0;m- Limits the cache to MB megabytes, deleting the least recently used outputs first. Defaults to 256." << std::endl;
+        std::cout << "\033[0;32m--cache-stats \033[0;m- Used in place of the file, prints the cache's hits, misses and size. Takes \033[0;32m--cache-dir=DIR\033[0;m too." << std::endl;
+        std::cout << "\033[0;32m--batch \033[0;m- Used in place of the file, followed by the mode, flags and any number of files: compiles them all at once on every core. Each 'name.dum' becomes 'name.asm' (and 'name' with \033[0;32m-a\033[0;m) next to it. Also takes \033[0;32m--manifest=FILE\033[0;m (one file per line), \033[0;32m--out-dir=DIR\033[0;m and \033[0;32m--jobs=N\033[0;m." << std::endl;
+        std::cout << "\033[0;32m--mmap-output \033[0;m- Writes 'out.asm' through a memory mapping of the file instead of buffered writes." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    if (std::string(argv[1]) == "--cache-stats") {
+        CompileCache cache(flag_value(argc, argv, "--cache-dir").value_or(CompileCache::default_dir().string()));
+        CacheStats stats = cache.stats();
+        std::cout << "hits: " << stats.hits << std::endl;
+        std::cout << "misses: " << stats.misses << std::endl;
+        std::cout << "entries: " << stats.entries << std::endl;
+        std::cout << "bytes: " << stats.bytes << std::endl;
         return EXIT_SUCCESS;
     }
 
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        if (input.fail()) {
-            std::cerr << "File not found: `" << argv[1] << "`." << std::endl;
+    // the mode is the first argument after the file; anything else is a flag
+    std::string mode = argc > 2 ? argv[2] : "-asm";
+    bool optimize = !has_flag(argc, argv, "-O0", "--no-optimize");
+    CompileOptions options {
+        .optimize = optimize,
+        .stream = has_flag(argc, argv, "--stream", "--stream"),
+        .mmap_output = has_flag(argc, argv, "--mmap-output", "--mmap-output"),
+        .generator = {
+            .regalloc = has_flag(argc, argv, "-ra", "--regalloc"),
+            .strength_reduce = optimize,
+            .peephole = optimize && !has_flag(argc, argv, "--no-peephole", "--no-peephole"),
+            .inline_functions = optimize && !has_flag(argc, argv, "--no-inline", "--no-inline"),
+            .drop_dead_functions = optimize,
+            .eliminate_dead_code = optimize,
+        },
+    };
+    if (std::optional<std::string> limit = flag_value(argc, argv, "--inline-limit")) {
+        auto [end, err] = std::from_chars(limit->data(), limit->data() + limit->size(), options.generator.inline_limit);
+        if (err != std::errc() || end != limit->data() + limit->size()) {
+            std::cerr << "Invalid inline limit: `" << limit.value() << "`." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (std::optional<std::string> rules = flag_value(argc, argv, "--no-peephole")) {
+        std::stringstream list(rules.value());
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            std::optional<PeepholeRule> rule = peephole_rule_from_name(name);
+            if (!rule.has_value()) {
+                std::cerr << "Unknown peephole rule: `" << name << "`." << std::endl;
+                return EXIT_FAILURE;
+            }
+            options.generator.peephole_options.enabled[static_cast<int>(rule.value())] = false;
+        }
+    }
+
+    if (std::string(argv[1]) == "--batch") {
+        // every argument that isn't a flag is an input, as is every line of the manifest
+        std::vector<std::string> inputs;
+        for (int i = 2; i < argc; i++) {
+            if (argv[i][0] != '-') {
+                inputs.emplace_back(argv[i]);
+            }
+        }
+        if (std::optional<std::string> manifest_path = flag_value(argc, argv, "--manifest")) {
+            std::ifstream manifest(manifest_path.value());
+            if (!manifest) {
+                std::cerr << "File not found: `" << manifest_path.value() << "`." << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::string line;
+            while (std::getline(manifest, line)) {
+                if (!line.empty() && line[0] != '#') {
+                    inputs.push_back(line);
+                }
+            }
+        }
+        if (has_flag(argc, argv, "--nasm", "--nasm")) {
+            std::cerr << "--nasm can't be used with --batch." << std::endl;
+            return EXIT_FAILURE;
+        }
+        bool link = has_flag(argc, argv, "-a", "--all");
+        std::string out_dir = flag_value(argc, argv, "--out-dir").value_or("");
+        if (!out_dir.empty()) {
+            std::error_code err;
+            std::filesystem::create_directories(out_dir, err);
+        }
+        std::vector<CompileJob> jobs;
+        std::unordered_set<std::string> outputs;
+        for (const std::string& input : inputs) {
+            jobs.push_back(job_for(input, out_dir, link));
+            if (!outputs.insert(jobs.back().asm_path).second) {
+                std::cerr << "More than one input would be written to `" << jobs.back().asm_path << "`." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        size_t threads = 0;
+        if (std::optional<std::string> count = flag_value(argc, argv, "--jobs")) {
+            auto [end, err] = std::from_chars(count->data(), count->data() + count->size(), threads);
+            if (err != std::errc() || end != count->data() + count->size()) {
+                std::cerr << "Invalid job count: `" << count.value() << "`." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        return compile_batch(jobs, options, threads) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // mapped read-only; tokens are views into it, so it stays alive until main returns
+    SourceFile source(argv[1]);
+    if (!source.ok()) {
+        std::cerr << "File not found: `" << argv[1] << "`." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // --time-report and --trace=FILE time every phase of the compile
+    bool time_report = has_flag(argc, argv, "--time-report", "--time-report");
+    std::optional<std::string> trace_path = flag_value(argc, argv, "--trace");
+    std::optional<Profiler> phases;
+    if (time_report || trace_path.has_value()) {
+        phases.emplace();
+    }
+    Profiler* profiler = phases.has_value() ? &phases.value() : nullptr;
+
+    // Outputs are cached by source, compiler build and flags. Modes that print
+    // instead of writing files, and reports that need the phases to actually run,
+    // bypass the cache.
+    bool link = mode == "-a" || mode == "--all";
+    bool use_nasm = has_flag(argc, argv, "--nasm", "--nasm");
+    std::optional<std::string> cache_dir = flag_value(argc, argv, "--cache-dir");
+    std::optional<CompileCache> cache;
+    std::vector<std::string> artifacts { "out.asm" };
+    if (link) {
+        if (use_nasm) {
+            artifacts.emplace_back("out.o");
+        }
+        artifacts.emplace_back("out");
+    }
+    uint64_t cache_key = 0;
+    if ((has_flag(argc, argv, "--cache", "--cache") || cache_dir.has_value())
+        && mode != "-tk" && mode != "--tokenization" && mode != "-ast" && mode != "--syntax-tree"
+        && mode != "-bast" && mode != "--binary-syntax-tree"
+        && !has_flag(argc, argv, "--peephole-report", "--peephole-report") && profiler == nullptr) {
+        uint64_t max_bytes = CompileCache::default_max_bytes;
+        if (std::optional<std::string> size = flag_value(argc, argv, "--cache-size")) {
+            uint64_t megabytes = 0;
+            auto [end, err] = std::from_chars(size->data(), size->data() + size->size(), megabytes);
+            if (err != std::errc() || end != size->data() + size->size()) {
+                std::cerr << "Invalid cache size: `" << size.value() << "`." << std::endl;
+                return EXIT_FAILURE;
+            }
+            max_bytes = megabytes * 1024 * 1024;
+        }
+        if (std::optional<uint64_t> build = compiler_build()) {
+            cache.emplace(cache_dir.value_or(CompileCache::default_dir().string()), max_bytes);
+            std::string config = std::to_string(build.value());
+            config += '\0' + mode;
+            for (int i = 3; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg != "--cache" && !arg.starts_with("--cache-dir=") && !arg.starts_with("--cache-size=")) {
+                    config += '\0' + arg;
+                }
+            }
+            cache_key = CompileCache::key(source.view(), config);
+            if (cache->ok() && cache->restore(cache_key, artifacts)) {
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+
+    // a binary AST written by -bast is used in place, skipping straight to its tree
+    std::optional<AstFile> ast_file;
+    if (is_ast_file(source.view())) {
+        ast_file.emplace(source.view());
+        if (!ast_file->check()) {
+            std::cerr << "Unable to load `" << argv[1] << "`: " << ast_file->error() << "." << std::endl;
             return EXIT_FAILURE;
         }
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
     }
 
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+    Interner symbols;
+    Tokenizer tokenizer(source.view(), symbols);
 
-    if (std::string(argv[2]) == "-tk"||std::string(argv[2])=="--tokenization") {
+    if (mode == "-tk" || mode == "--tokenization") {
+        if (ast_file.has_value()) {
+            std::cerr << "`" << argv[1] << "` is a binary AST and has no tokens." << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::vector<Token> tokens = tokenizer.tokenize();
         std::cout << "[";
-        for (int i = 0; i < tokens.size(); i++) {
+        for (size_t i = 0; i < tokens.size(); i++) {
             std::cout << TokenTypes[int(tokens.at(i).type)] << ", ";
         }
         std::cout << "]" << std::endl;
         return EXIT_SUCCESS;
     }
 
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
-    if (!prog.has_value()) {
-        std::cerr << "Parser error" << std::endl;
+    bool binary_ast = mode == "-bast" || mode == "--binary-syntax-tree";
+    if (mode == "-ast" || mode == "--syntax-tree" || binary_ast) {
+        FlatAst flat_ast;
+        FlatAstView tree;
+        if (ast_file.has_value()) {
+            tree = ast_file->view();
+        }
+        else {
+            Parser parser(tokenizer);
+            std::optional<NodeProg> prog = parser.parse_prog();
+            if (!prog.has_value()) {
+                std::cerr << "Parser error" << std::endl;
+                return EXIT_FAILURE;
+            }
+            // -bast saves what the generator would see
+            if (binary_ast && optimize) {
+                ConstFolder(parser.allocator()).fold_prog(prog.value());
+            }
+            flat_ast = flatten(prog.value());
+            tree = flat_ast.view();
+        }
+        if (binary_ast) {
+            FileSink out("out.ast");
+            write_ast_file(tree, out);
+            if (!out.finish()) {
+                std::cerr << "Unable to write `out.ast`." << std::endl;
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        FileSink out(STDOUT_FILENO);
+        AstPrinter(tree, out, has_flag(argc, argv, "--pretty", "--pretty")).write_prog();
+        return out.finish() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    std::string exe_path = link && !use_nasm ? "out" : "";
+    CompileResult result;
+    if (ast_file.has_value()) {
+        result = compile_ast(ast_file->view(), "out.asm", exe_path, options, profiler);
+    }
+    else {
+        ArenaAllocator arena(1024 * 1024 * 4); // 4 mb
+        result = compile_source(source.view(), "out.asm", exe_path, options, arena, profiler);
+    }
+    if (!result.ok) {
+        std::cerr << result.error << std::endl;
         return EXIT_FAILURE;
     }
 
-    if (std::string(argv[2]) == "-ast" || std::string(argv[2]) == "--syntax-tree") {
-        std::cout << parser.prog_to_string(prog.value()) << std::endl;
-        return EXIT_SUCCESS;
+    if (has_flag(argc, argv, "--peephole-report", "--peephole-report")) {
+        for (size_t i = 0; i < peephole_rule_count; i++) {
+            std::cerr << peephole_rule_name(static_cast<PeepholeRule>(i)) << ": " << result.peephole_stats.removed[i] << " instructions removed" << std::endl;
+        }
+    }
+
+    if (link && use_nasm) {
+        {
+            ProfileScope scope(profiler, "nasm");
+            if (system("nasm -felf64 out.asm") != 0) {
+                std::cerr << "Unable to assemble `out.asm` with nasm." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        ProfileScope scope(profiler, "ld");
+        if (system("ld -o out out.o") != 0) {
+            std::cerr << "Unable to link `out.o` with ld." << std::endl;
+            return EXIT_FAILURE;
+        }
     }
 
-    Generator generator(prog.value());
-    {
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+    if (time_report) {
+        profiler->report(std::cerr);
+    }
+    if (trace_path.has_value()) {
+        FileSink trace(trace_path.value());
+        profiler->write_trace(trace);
+        if (!trace.finish()) {
+            std::cerr << "Unable to write `" << trace_path.value() << "`." << std::endl;
+            return EXIT_FAILURE;
+        }
     }
 
-    if (std::string(argv[2])=="-a"||std::string(argv[2])=="--all") {
-        system("nasm -felf64 out.asm");
-        system("ld -o out out.o");
+    if (cache.has_value() && cache->ok()) {
+        cache->store(cache_key, artifacts);
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[])
+{
+    // the modes that print tokens or trees run the phases without the driver
+    try {
+        return run(argc, argv);
+    }
+    catch (const CompileError& error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
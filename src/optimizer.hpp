@@ -0,0 +1,294 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "./parser.hpp"
+
+// Constant folding and propagation over the Parser's AST. Binary expressions whose
+// operands are known are replaced by an integer literal, identifiers bound by a `let`
+// with a known value are replaced by that value (variables are never reassigned, so
+// every `let` is a constant), and `if`s with a known condition are either unwrapped
+// into their scope or dropped. Arithmetic matches the generated code: unsigned 64-bit
+// with wrap-around. Division by zero is left alone so it still faults at run time.
+// New nodes and literal text come from the parser's arena.
+class ConstFolder {
+public:
+    inline explicit ConstFolder(ArenaAllocator& allocator)
+        : m_allocator(allocator)
+    {
+    }
+
+    void fold_prog(NodeProg& prog)
+    {
+        prog.stmts = fold_stmts(prog.stmts);
+    }
+
+    // Folds one top-level statement, remembering its constants for the statements
+    // after it. Returns false if the statement folded away.
+    bool fold_top_level(NodeStmt* stmt)
+    {
+        return fold_stmt(stmt);
+    }
+
+private:
+    std::optional<uint64_t> fold_term(NodeTerm* term)
+    {
+        struct TermVisitor {
+            ConstFolder& folder;
+            NodeTerm* term;
+            std::optional<uint64_t> operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                return parse_int(term_int_lit->int_lit.value.value());
+            }
+            std::optional<uint64_t> operator()(const NodeTermIdent* term_ident) const
+            {
+                std::optional<uint64_t> value = folder.lookup(term_ident->ident.symbol);
+                if (value.has_value()) {
+                    term->var = folder.make_int_lit(value.value());
+                }
+                return value;
+            }
+            std::optional<uint64_t> operator()(const NodeTermParen* term_paren) const
+            {
+                std::optional<uint64_t> value = folder.fold_expr(term_paren->expr);
+                if (value.has_value()) {
+                    term->var = folder.make_int_lit(value.value());
+                }
+                return value;
+            }
+            std::optional<uint64_t> operator()(const NodeTermCall* term_call) const
+            {
+                for (NodeExpr* arg : term_call->args) {
+                    folder.fold_expr(arg);
+                }
+                return {};
+            }
+        };
+        return std::visit(TermVisitor { .folder = *this, .term = term }, term->var);
+    }
+
+    std::optional<uint64_t> fold_bin_expr(const NodeBinExpr* bin_expr)
+    {
+        struct BinExprVisitor {
+            ConstFolder& folder;
+            std::optional<uint64_t> operator()(const NodeBinExprAdd* add) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(add->lhs, add->rhs);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return lhs.value() + rhs.value();
+            }
+            std::optional<uint64_t> operator()(const NodeBinExprSub* sub) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(sub->lhs, sub->rhs);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return lhs.value() - rhs.value();
+            }
+            std::optional<uint64_t> operator()(const NodeBinExprMulti* multi) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(multi->lhs, multi->rhs);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return lhs.value() * rhs.value();
+            }
+            std::optional<uint64_t> operator()(const NodeBinExprDiv* div) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(div->lhs, div->rhs);
+                if (!lhs.has_value() || !rhs.has_value() || rhs.value() == 0) {
+                    return {};
+                }
+                return lhs.value() / rhs.value();
+            }
+            std::optional<uint64_t> operator()(const NodeBinExprLessThan* less_than) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(less_than->lhs, less_than->rhs);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return lhs.value() < rhs.value() ? 1 : 0;
+            }
+            std::optional<uint64_t> operator()(const NodeBinExprGreaterThan* greater_than) const
+            {
+                auto [lhs, rhs] = folder.fold_operands(greater_than->lhs, greater_than->rhs);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return lhs.value() > rhs.value() ? 1 : 0;
+            }
+        };
+        return std::visit(BinExprVisitor { .folder = *this }, bin_expr->var);
+    }
+
+    // Folds `expr` in place and returns its value if it is now a constant.
+    std::optional<uint64_t> fold_expr(NodeExpr* expr)
+    {
+        struct ExprVisitor {
+            ConstFolder& folder;
+            std::optional<uint64_t> operator()(NodeTerm* term) const
+            {
+                return folder.fold_term(term);
+            }
+            std::optional<uint64_t> operator()(const NodeBinExpr* bin_expr) const
+            {
+                return folder.fold_bin_expr(bin_expr);
+            }
+        };
+        std::optional<uint64_t> value = std::visit(ExprVisitor { .folder = *this }, expr->var);
+        if (value.has_value() && std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = make_int_lit(value.value());
+            expr->var = term;
+        }
+        return value;
+    }
+
+    std::pair<std::optional<uint64_t>, std::optional<uint64_t>> fold_operands(NodeExpr* lhs, NodeExpr* rhs)
+    {
+        std::optional<uint64_t> lhs_value = fold_expr(lhs);
+        return { lhs_value, fold_expr(rhs) };
+    }
+
+    void fold_scope(NodeScope* scope)
+    {
+        size_t mark = m_consts.size();
+        scope->stmts = fold_stmts(scope->stmts);
+        unbind_to(mark);
+    }
+
+    // Folds every statement and compacts away the ones that fold to nothing.
+    std::span<NodeStmt*> fold_stmts(std::span<NodeStmt*> stmts)
+    {
+        size_t kept = 0;
+        for (NodeStmt* stmt : stmts) {
+            if (fold_stmt(stmt)) {
+                stmts[kept++] = stmt;
+            }
+        }
+        return stmts.first(kept);
+    }
+
+    // Returns false if the statement can be dropped.
+    bool fold_stmt(NodeStmt* stmt)
+    {
+        struct StmtVisitor {
+            ConstFolder& folder;
+            NodeStmt* stmt;
+            bool operator()(const NodeStmtExit* stmt_exit) const
+            {
+                folder.fold_expr(stmt_exit->expr);
+                return true;
+            }
+            bool operator()(const NodeStmtLet* stmt_let) const
+            {
+                folder.bind(stmt_let->ident.symbol, folder.fold_expr(stmt_let->expr));
+                return true;
+            }
+            bool operator()(NodeScope* scope) const
+            {
+                folder.fold_scope(scope);
+                return true;
+            }
+            bool operator()(const NodeStmtIf* stmt_if) const
+            {
+                std::optional<uint64_t> cond = folder.fold_expr(stmt_if->expr);
+                folder.fold_scope(stmt_if->scope);
+                if (!cond.has_value()) {
+                    return true;
+                }
+                if (cond.value() == 0) {
+                    return false;
+                }
+                stmt->var = stmt_if->scope;
+                return true;
+            }
+            bool operator()(const NodeStmtFunction* func) const
+            {
+                // the body only sees its parameters, which are unknown
+                size_t mark = folder.m_consts.size();
+                size_t outer_visible = std::exchange(folder.m_visible, mark);
+                for (const Token& param : func->parameters) {
+                    folder.bind(param.symbol, std::nullopt);
+                }
+                folder.fold_scope(func->scope);
+                folder.unbind_to(mark);
+                folder.m_visible = outer_visible;
+                return true;
+            }
+            bool operator()(const NodeStmtReturn* stmt_return) const
+            {
+                folder.fold_expr(stmt_return->expr);
+                return true;
+            }
+        };
+        return std::visit(StmtVisitor { .folder = *this, .stmt = stmt }, stmt->var);
+    }
+
+    void bind(uint32_t symbol, std::optional<uint64_t> value)
+    {
+        if (symbol >= m_bindings.size()) {
+            m_bindings.resize(symbol + 1, no_binding);
+        }
+        m_consts.push_back({ .symbol = symbol, .value = value, .shadowed = m_bindings[symbol] });
+        m_bindings[symbol] = static_cast<uint32_t>(m_consts.size() - 1);
+    }
+
+    // forgets every binding made since m_consts had `mark` entries
+    void unbind_to(size_t mark)
+    {
+        while (m_consts.size() > mark) {
+            m_bindings[m_consts.back().symbol] = m_consts.back().shadowed;
+            m_consts.pop_back();
+        }
+    }
+
+    [[nodiscard]] std::optional<uint64_t> lookup(uint32_t symbol) const
+    {
+        if (symbol >= m_bindings.size() || m_bindings[symbol] == no_binding || m_bindings[symbol] < m_visible) {
+            return {};
+        }
+        return m_consts[m_bindings[symbol]].value;
+    }
+
+    static std::optional<uint64_t> parse_int(std::string_view text)
+    {
+        uint64_t value;
+        auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (err != std::errc() || end != text.data() + text.size()) {
+            return {}; // too big for 64 bits, leave it to the assembler
+        }
+        return value;
+    }
+
+    NodeTermIntLit* make_int_lit(uint64_t value)
+    {
+        char buf[20];
+        auto [end, err] = std::to_chars(buf, buf + sizeof(buf), value);
+        std::span<char> text = m_allocator.alloc_array<char>(std::span<const char>(buf, end));
+        auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+        int_lit->int_lit = { .type = TokenType::int_lit, .value = std::string_view(text.data(), text.size()) };
+        return int_lit;
+    }
+
+    struct Binding {
+        uint32_t symbol;
+        std::optional<uint64_t> value; // nullopt when not constant
+        uint32_t shadowed; // the binding of the same symbol this one hides, or no_binding
+    };
+    static constexpr uint32_t no_binding = UINT32_MAX;
+
+    ArenaAllocator& m_allocator;
+    std::vector<Binding> m_consts; // every binding in scope, innermost last
+    std::vector<uint32_t> m_bindings; // symbol -> its innermost entry in m_consts, or no_binding
+    size_t m_visible = 0; // entries before this one are outside the function being folded
+};
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Destination for generated text. Writers append into a window of memory owned by
+// the sink and only call back into it when the window is full, so emitting a line
+// is a couple of memcpys. Integers are formatted in place with std::to_chars.
+class OutputSink {
+public:
+    inline OutputSink() = default;
+
+    inline OutputSink(const OutputSink& other) = delete;
+
+    inline OutputSink operator=(const OutputSink& other) = delete;
+
+    virtual ~OutputSink() = default;
+
+    inline void write(std::string_view text)
+    {
+        if (static_cast<size_t>(m_end - m_pos) < text.size()) {
+            write_slow(text);
+            return;
+        }
+        std::memcpy(m_pos, text.data(), text.size());
+        m_pos += text.size();
+    }
+
+    inline void write_int(int64_t value)
+    {
+        reserve(20);
+        m_pos = std::to_chars(m_pos, m_end, value).ptr;
+    }
+
+    inline OutputSink& operator<<(std::string_view text)
+    {
+        write(text);
+        return *this;
+    }
+
+    inline OutputSink& operator<<(int64_t value)
+    {
+        write_int(value);
+        return *this;
+    }
+
+    // Pushes out whatever is still buffered. Returns false if anything failed to
+    // be written, here or during an earlier overflow.
+    virtual bool finish() = 0;
+
+    // bytes written so far
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_flushed + (m_pos - m_begin);
+    }
+
+protected:
+    // Makes at least `needed` bytes available at m_pos, moving m_begin/m_pos/m_end.
+    virtual void overflow(size_t needed) = 0;
+
+    inline void reserve(size_t needed)
+    {
+        if (static_cast<size_t>(m_end - m_pos) < needed) {
+            overflow(needed);
+        }
+    }
+
+    char* m_begin = nullptr;
+    char* m_pos = nullptr;
+    char* m_end = nullptr;
+    size_t m_flushed = 0; // bytes before m_begin that are already out
+
+private:
+    inline void write_slow(std::string_view text)
+    {
+        while (!text.empty()) {
+            reserve(1);
+            size_t n = std::min(text.size(), static_cast<size_t>(m_end - m_pos));
+            std::memcpy(m_pos, text.data(), n);
+            m_pos += n;
+            text.remove_prefix(n);
+        }
+    }
+};
+
+// Collects everything in memory, for callers that want the text as a string.
+class StringSink final : public OutputSink {
+public:
+    inline bool finish() override
+    {
+        m_text.resize(m_pos - m_begin);
+        return true;
+    }
+
+    // only valid after finish()
+    [[nodiscard]] inline const std::string& str() const
+    {
+        return m_text;
+    }
+
+protected:
+    inline void overflow(size_t needed) override
+    {
+        size_t used = m_pos - m_begin;
+        m_text.resize(std::max(m_text.size() * 2, used + std::max<size_t>(needed, 4096)));
+        m_begin = m_text.data();
+        m_pos = m_begin + used;
+        m_end = m_begin + m_text.size();
+    }
+
+private:
+    std::string m_text;
+};
+
+// Buffers into one reusable block and hands it to write(2) whenever it fills up.
+class FileSink final : public OutputSink {
+public:
+    static constexpr size_t default_block_size = 1 << 20;
+
+    inline explicit FileSink(const std::string& path, size_t block_size = default_block_size)
+        : m_block(block_size)
+    {
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        m_ok = m_fd >= 0;
+        m_begin = m_pos = m_block.data();
+        m_end = m_begin + m_block.size();
+    }
+
+    // writes to a descriptor that is already open, such as stdout, and leaves it open
+    inline explicit FileSink(int fd, size_t block_size = default_block_size)
+        : m_block(block_size)
+        , m_fd(fd)
+        , m_ok(fd >= 0)
+        , m_owns_fd(false)
+    {
+        m_begin = m_pos = m_block.data();
+        m_end = m_begin + m_block.size();
+    }
+
+    inline ~FileSink() override
+    {
+        if (m_fd >= 0 && m_owns_fd) {
+            close(m_fd);
+        }
+    }
+
+    [[nodiscard]] inline bool ok() const
+    {
+        return m_ok;
+    }
+
+    inline bool finish() override
+    {
+        flush();
+        if (m_fd >= 0 && m_owns_fd && close(m_fd) != 0) {
+            m_ok = false;
+        }
+        m_fd = -1;
+        return m_ok;
+    }
+
+protected:
+    inline void overflow(size_t needed) override
+    {
+        flush();
+        if (needed > m_block.size()) {
+            m_block.resize(needed);
+            m_begin = m_pos = m_block.data();
+            m_end = m_begin + m_block.size();
+        }
+    }
+
+private:
+    inline void flush()
+    {
+        const char* data = m_begin;
+        size_t size = m_pos - m_begin;
+        while (m_ok && size > 0) {
+            ssize_t n = ::write(m_fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                m_ok = false;
+                break;
+            }
+            data += n;
+            size -= n;
+        }
+        m_flushed += m_pos - m_begin;
+        m_pos = m_begin;
+    }
+
+    std::vector<char> m_block;
+    int m_fd = -1;
+    bool m_ok = false;
+    bool m_owns_fd = true;
+};
+
+// Writes straight into a shared mapping of the output file, growing the file (and
+// remapping it) geometrically; finish() truncates it to the bytes actually written.
+class MappedFileSink final : public OutputSink {
+public:
+    static constexpr size_t initial_size = 1 << 20;
+
+    inline explicit MappedFileSink(const std::string& path)
+    {
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        m_ok = m_fd >= 0 && remap(initial_size);
+    }
+
+    inline ~MappedFileSink() override
+    {
+        unmap();
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    [[nodiscard]] inline bool ok() const
+    {
+        return m_ok;
+    }
+
+    inline bool finish() override
+    {
+        if (m_fd < 0) {
+            return false;
+        }
+        size_t used = m_pos - m_begin;
+        unmap();
+        m_flushed = used;
+        if (ftruncate(m_fd, static_cast<off_t>(used)) != 0 || close(m_fd) != 0) {
+            m_ok = false;
+        }
+        m_fd = -1;
+        return m_ok;
+    }
+
+protected:
+    inline void overflow(size_t needed) override
+    {
+        size_t used = m_pos - m_begin;
+        size_t capacity = m_end - m_begin;
+        if (!m_ok || !remap(std::max(capacity * 2, used + needed))) {
+            // keep accepting output into a scratch block so writers need no checks
+            m_ok = false;
+            unmap();
+            m_scratch.resize(std::max({ m_scratch.size(), needed, size_t { 4096 } }));
+            m_begin = m_pos = m_scratch.data();
+            m_end = m_begin + m_scratch.size();
+        }
+    }
+
+private:
+    inline bool remap(size_t size)
+    {
+        size_t used = m_pos - m_begin;
+        if (ftruncate(m_fd, static_cast<off_t>(size)) != 0) {
+            return false;
+        }
+        void* mapped = m_begin == nullptr
+            ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0)
+            : mremap(m_begin, m_end - m_begin, size, MREMAP_MAYMOVE);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        m_begin = static_cast<char*>(mapped);
+        m_pos = m_begin + used;
+        m_end = m_begin + size;
+        return true;
+    }
+
+    inline void unmap()
+    {
+        if (m_begin != nullptr && m_begin != m_scratch.data()) {
+            munmap(m_begin, m_end - m_begin);
+        }
+        m_begin = m_pos = m_end = nullptr;
+    }
+
+    std::vector<char> m_scratch;
+    int m_fd = -1;
+    bool m_ok = false;
+};
\ No newline at end of file
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <span>
 #include <variant>
 
 #include "./arena.hpp"
+#include "./profile.hpp"
 #include "tokenization.hpp"
 
 struct NodeTermIntLit {
@@ -20,6 +23,11 @@ struct NodeTermParen {
     NodeExpr* expr;
 };
 
+struct NodeTermCall {
+    Token ident; // name of the function
+    std::span<NodeExpr*> args;
+};
+
 struct NodeBinExprAdd {
     NodeExpr* lhs;
     NodeExpr* rhs;
@@ -40,12 +48,23 @@ struct NodeBinExprDiv {
     NodeExpr* rhs;
 };
 
+// unsigned, 1 when it holds and 0 otherwise
+struct NodeBinExprLessThan {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprGreaterThan {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
 struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*> var;
+    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*, NodeBinExprLessThan*, NodeBinExprGreaterThan*> var;
 };
 
 struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermCall*> var;
 };
 
 struct NodeExpr {
@@ -61,16 +80,22 @@ struct NodeStmtLet {
     NodeExpr* expr;
 };
 
+struct NodeStmtReturn {
+    NodeExpr* expr;
+};
+
 struct NodeStmt;
 
+// Child lists are frozen into the parser's arena once they are complete, so the
+// whole tree lives in one allocation and nothing in it needs destroying.
 struct NodeScope {
-    std::vector<NodeStmt*> stmts;
+    std::span<NodeStmt*> stmts;
 };
 
 struct NodeStmtFunction {
     Token ident; // name of function
     NodeScope* scope;
-    std::vector<Token> parameters;
+    std::span<Token> parameters;
 };
 
 struct NodeStmtIf {
@@ -79,19 +104,53 @@ struct NodeStmtIf {
 };
 
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtFunction*> var;
+    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtFunction*, NodeStmtReturn*> var;
 };
 
 struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+    std::span<NodeStmt*> stmts;
 };
 
 class Parser {
 public:
-    inline explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens))
-        , m_allocator(1024 * 1024 * 4) // 4 mb
+    // Tokens are pulled from `tokenizer` as they are needed. The arena starts at
+    // `arena_bytes` and grows on demand.
+    inline explicit Parser(Tokenizer& tokenizer, size_t arena_bytes = 1024 * 1024 * 4) // 4 mb
+        : m_tokenizer(tokenizer)
+        , m_owned_allocator(std::in_place, arena_bytes)
+        , m_allocator(m_owned_allocator.value())
+    {
+    }
+
+    // Builds the tree in `allocator` instead, so one arena can be reused across
+    // many parses. The nodes live until the caller resets it.
+    inline Parser(Tokenizer& tokenizer, ArenaAllocator& allocator)
+        : m_tokenizer(tokenizer)
+        , m_allocator(allocator)
+    {
+    }
+
+    [[nodiscard]] inline ArenaStats arena_stats() const
+    {
+        return m_allocator.stats();
+    }
+
+    // how many tokens have been pulled from the tokenizer so far
+    [[nodiscard]] inline size_t token_count() const
+    {
+        return m_token_count;
+    }
+
+    // times pulling tokens as the "tokenize" phase
+    inline void set_profiler(Profiler* profiler)
+    {
+        m_profiler = profiler;
+    }
+
+    // for passes that rewrite the tree and need to allocate nodes next to it
+    inline ArenaAllocator& allocator()
     {
+        return m_allocator;
     }
 
     std::optional<NodeTerm*> parse_term()
@@ -103,6 +162,29 @@ public:
             term->var = term_int_lit;
             return term;
         }
+        else if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()
+            && peek(1).value().type == TokenType::open_paren) {
+            auto term_call = m_allocator.alloc<NodeTermCall>();
+            term_call->ident = consume();
+            consume();
+            size_t start = m_expr_scratch.size();
+            while (peek().has_value() && peek().value().type != TokenType::close_paren) {
+                if (auto arg = parse_expr()) {
+                    m_expr_scratch.push_back(arg.value());
+                }
+                else {
+                    compile_error("Invalid expression for function argument");
+                }
+                if (peek().has_value() && peek().value().type != TokenType::close_paren) {
+                    try_consume(TokenType::comma, "Expected comma to seperate arguments in function call");
+                }
+            }
+            try_consume(TokenType::close_paren, "Expected `)` after function arguments");
+            term_call->args = freeze(m_expr_scratch, start);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_call;
+            return term;
+        }
         else if (auto ident = try_consume(TokenType::ident)) {
             auto expr_ident = m_allocator.alloc<NodeTermIdent>();
             expr_ident->ident = ident.value();
@@ -113,8 +195,7 @@ public:
         else if (auto open_paren = try_consume(TokenType::open_paren)) {
             auto expr = parse_expr();
             if (!expr.has_value()) {
-                std::cerr << "Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Expected expression");
             }
             try_consume(TokenType::close_paren, "Expected `)`");
             auto term_paren = m_allocator.alloc<NodeTermParen>();
@@ -153,8 +234,7 @@ public:
             int next_min_prec = prec.value() + 1;
             auto expr_rhs = parse_expr(next_min_prec);
             if (!expr_rhs.has_value()) {
-                std::cerr << "Unable to parse expression" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Unable to parse expression");
             }
             auto expr = m_allocator.alloc<NodeBinExpr>();
             auto expr_lhs2 = m_allocator.alloc<NodeExpr>();
@@ -186,6 +266,20 @@ public:
                 div->rhs = expr_rhs.value();
                 expr->var = div;
             }
+            else if (op.type == TokenType::less_than) {
+                auto less_than = m_allocator.alloc<NodeBinExprLessThan>();
+                expr_lhs2->var = expr_lhs->var;
+                less_than->lhs = expr_lhs2;
+                less_than->rhs = expr_rhs.value();
+                expr->var = less_than;
+            }
+            else if (op.type == TokenType::greater_than) {
+                auto greater_than = m_allocator.alloc<NodeBinExprGreaterThan>();
+                expr_lhs2->var = expr_lhs->var;
+                greater_than->lhs = expr_lhs2;
+                greater_than->rhs = expr_rhs.value();
+                expr->var = greater_than;
+            }
             else {
                 assert(false); // Unreachable - all binary operators have been checked for
             }
@@ -199,17 +293,21 @@ public:
         if (!try_consume(TokenType::open_brace).has_value()) {
             return {}; // It's not a scope
         }
+        m_scope_depth++;
         auto scope = m_allocator.alloc<NodeScope>();
+        size_t start = m_stmt_scratch.size();
         while (auto stmt = parse_stmt()) {
-            scope->stmts.push_back(stmt.value());
+            m_stmt_scratch.push_back(stmt.value());
         }
+        scope->stmts = freeze(m_stmt_scratch, start);
         try_consume(TokenType::close_brace, "Expected `}` to close scope");
+        m_scope_depth--;
         return scope;
     }
 
     std::optional<NodeStmt*> parse_stmt()
     {
-        if (peek().value().type == TokenType::exit && peek(1).has_value()
+        if (peek().has_value() && peek().value().type == TokenType::exit && peek(1).has_value()
             && peek(1).value().type == TokenType::open_paren) {
             consume();
             consume();
@@ -218,8 +316,7 @@ public:
                 stmt_exit->expr = node_expr.value();
             }
             else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Invalid expression");
             }
             try_consume(TokenType::close_paren, "Expected `)` after exit expression");
             try_consume(TokenType::semicolon, "Expected `;` after exit");
@@ -239,8 +336,7 @@ public:
                 stmt_let->expr = expr.value();
             }
             else {
-                std::cerr << "Invalid expression for variable value" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Invalid expression for variable value");
             }
             try_consume(TokenType::semicolon, "Expected `;` after variable declaration");
             auto stmt = m_allocator.alloc<NodeStmt>();
@@ -254,8 +350,7 @@ public:
                 return stmt;
             }
             else {
-                std::cerr << "Invalid scope" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Invalid scope");
             }
         }
         else if (auto if_ = try_consume(TokenType::if_)) {
@@ -265,220 +360,144 @@ public:
                 stmt_if->expr = expr.value();
             }
             else {
-                std::cerr << "Invalid expression for if statement clause" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Invalid expression for if statement clause");
             }
             try_consume(TokenType::close_paren, "Expected `)` for if statement");
             if (auto scope = parse_scope()) {
                 stmt_if->scope = scope.value();
             }
             else {
-                std::cerr << "Invalid scope for if statement" << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error("Invalid scope for if statement");
             }
             auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = stmt_if;
             return stmt;
-        } else if (auto function = try_consume(TokenType::function)) {
+        }
+        else if (try_consume(TokenType::function)) {
+            // bodies are compiled out of line and only see their parameters, so
+            // there is nothing for a nested definition to capture
+            if (m_scope_depth != 0) {
+                compile_error("Functions can only be defined at the top level");
+            }
             Token ident = try_consume(TokenType::ident, "Expected function name following function keyword");
             auto stmt_func = m_allocator.alloc<NodeStmtFunction>();
             stmt_func->ident = ident;
             try_consume(TokenType::open_paren, "Expected open parenthesis for function parameters");
-            std::vector<Token> parameters;
+            size_t start = m_param_scratch.size();
             while (peek().has_value() && peek().value().type != TokenType::close_paren) {
-                parameters.push_back(consume());
+                m_param_scratch.push_back(try_consume(TokenType::ident, "Expected parameter name in function declaration"));
                 // expect either a comma (another parameter) or close paren
                 if (peek().has_value() && peek().value().type != TokenType::close_paren) {
                     try_consume(TokenType::comma, "Expected comma to seperate parameters in function declaration");
                 }
             }
-            consume(); // consume the )
-            stmt_func->parameters = parameters;
+            try_consume(TokenType::close_paren, "Expected `)` after function parameters");
+            stmt_func->parameters = freeze(m_param_scratch, start);
+            m_in_function = true;
             if (auto scope = parse_scope()) {
                 stmt_func->scope = scope.value();
-            } else {
-                std::cerr << "Invalid scope for function statements" << std::endl;
-                exit(EXIT_FAILURE);
             }
+            else {
+                compile_error("Invalid scope for function statements");
+            }
+            m_in_function = false;
             auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = stmt_func;
             return stmt;
         }
+        else if (try_consume(TokenType::return_)) {
+            if (!m_in_function) {
+                compile_error("`return` outside of a function");
+            }
+            auto stmt_return = m_allocator.alloc<NodeStmtReturn>();
+            if (auto expr = parse_expr()) {
+                stmt_return->expr = expr.value();
+            }
+            else {
+                compile_error("Invalid expression for return value");
+            }
+            try_consume(TokenType::semicolon, "Expected `;` after return");
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_return;
+            return stmt;
+        }
         else {
             return {};
         }
     }
 
+    // The next top-level statement, or nullopt once the input is used up. Lets a
+    // program be compiled one statement at a time.
+    std::optional<NodeStmt*> parse_top_level()
+    {
+        if (!peek().has_value()) {
+            return {};
+        }
+        if (auto stmt = parse_stmt()) {
+            return stmt;
+        }
+        compile_error("Invalid statement");
+    }
+
     std::optional<NodeProg> parse_prog()
     {
         NodeProg prog;
-        while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(stmt.value());
-            }
-            else {
-                std::cerr << "Invalid statement" << std::endl;
-                exit(EXIT_FAILURE);
-            }
+        size_t start = m_stmt_scratch.size();
+        while (auto stmt = parse_top_level()) {
+            m_stmt_scratch.push_back(stmt.value());
         }
+        prog.stmts = freeze(m_stmt_scratch, start);
         return prog;
     }
 
-    // -------------------- PRETTY PRINTING - CONVERT AST INTO STRING ----------------------
-
-
-    std::string bin_expr_to_string(const NodeBinExpr* bin_expr) {
-        std::stringstream stream;
-        struct Visitor {
-            std::stringstream& stream;
-            Parser& parser;
-            void operator()(const NodeBinExprAdd* add) const {
-                stream << "{\"type\":\"add\",\"left\":";
-                stream << parser.expr_to_string(add->lhs);
-                stream << ",\"right\":";
-                stream << parser.expr_to_string(add->rhs);
-                stream << "}";
-            }
-            void operator()(const NodeBinExprSub* sub) const {
-                stream << "{\"type\":\"sub\",\"left\":";
-                stream << parser.expr_to_string(sub->lhs);
-                stream << ",\"right\":";
-                stream << parser.expr_to_string(sub->rhs);
-                stream << "}";
-            }
-            void operator()(const NodeBinExprDiv* div) const {
-                stream << "{\"type\":\"sub\",\"left\":";
-                stream << parser.expr_to_string(div->lhs);
-                stream << ",\"right\":";
-                stream << parser.expr_to_string(div->rhs);
-                stream << "}";
-            }
-            void operator()(const NodeBinExprMulti* mul) const {
-                stream << "{\"type\":\"mul\",\"left\":";
-                stream << parser.expr_to_string(mul->lhs);
-                stream << ",\"right\":";
-                stream << parser.expr_to_string(mul->rhs);
-                stream << "}";
-            }
-        };
-        Visitor visitor ({.stream = stream,.parser=*this});
-        std::visit(visitor, bin_expr->var);
-        return stream.str();
-    }
-
-    std::string term_to_string(const NodeTerm* term) {
-        std::stringstream stream;
-        struct Visitor {
-            std::stringstream& stream;
-            Parser& parser;
-            void operator()(const NodeTermIdent* ident) {
-                stream << "{\"type\":\"identifier\",\"identifier\":\"" << ident->ident.value.value() << "}";
-            }
-            void operator()(const NodeTermIntLit* int_lit) {
-                stream << "{\"type\":\"integer_literal\",\"value\":" << int_lit->int_lit.value.value() << "}";
-            }
-            void operator()(const NodeTermParen* parenthesis) {
-                stream << "{\"type\":\"parenthesis\",\"value\":" << parser.expr_to_string(parenthesis->expr) << "}";
-            }
-        };
-        Visitor visitor ({.stream=stream,.parser=*this});
-        std::visit(visitor,term->var);
-        return stream.str();
-    }
-
-    std::string expr_to_string(const NodeExpr* expr) {
-        std::stringstream stream;
-        struct Visitor {
-            std::stringstream& stream;
-            Parser& parser;
-            void operator()(const NodeTerm* term) const {
-                stream << "{\"type\":\"term\",\"variant\":";
-                stream << parser.term_to_string(term);
-                stream << "}";
-            }
-            void operator()(const NodeBinExpr* bin_expr) const {
-                stream << "{\"type\":\"binary_expression\",\"operation\":";
-                stream << parser.bin_expr_to_string(bin_expr);
-                stream << "}";
-            }
-        };
-        Visitor visitor ({.stream = stream, .parser = *this});
-        std::visit(visitor,expr->var);
-        return stream.str();
+private:
+    // Copy the items pushed onto `scratch` since `start` into the arena and pop them
+    // off again. Nested lists share one scratch stack, so it stops reallocating once
+    // it has grown to the deepest nesting.
+    template <typename T>
+    inline std::span<T> freeze(std::vector<T>& scratch, size_t start)
+    {
+        std::span<T> list = m_allocator.alloc_array<T>(std::span<const T>(scratch).subspan(start));
+        scratch.resize(start);
+        return list;
     }
 
-    std::string stmt_to_string(const NodeStmt* stmt) {
-        std::stringstream stream;
-        struct Visitor {
-            std::stringstream& stream;
-            Parser& parser;
-            void operator()(const NodeStmtExit* exit_stmt) const {
-                stream << "{\"type\":\"exit_statement\",\"expression\":";
-                stream << parser.expr_to_string(exit_stmt->expr);
-                stream << "}";
-            }
-            void operator()(const NodeStmtFunction* func_stmt) const {
-                stream << "{\"type\":\"function_statement\",\"identifier\":\"" << func_stmt->ident.value.value() << "\",\"parameters\":[";
-                for (int i = 0; i < func_stmt->parameters.size(); i++) {
-                    stream << "\"" << func_stmt->parameters.at(i).value.value() << "\",";
-                }
-                stream << "],\"body\":[";
-                for (int i = 0; i < func_stmt->scope->stmts.size(); i++) {
-                    stream << parser.stmt_to_string(func_stmt->scope->stmts.at(i)) << ",";
-                }
-                stream << "]}";
-            }
-            void operator()(const NodeStmtIf* if_stmt) const {
-                stream << "{\"type\":\"if_statement\",\"expression\":";
-                stream << parser.expr_to_string(if_stmt->expr);
-                stream << ",\"body\":[";
-                for (int i = 0; i < if_stmt->scope->stmts.size(); i++) {
-                    stream << parser.stmt_to_string(if_stmt->scope->stmts.at(i)) << ",";
-                }
-                stream << "]}";
-            }
-            void operator()(const NodeStmtLet* let_stmt) const {
-                stream << "{\"type\":\"var_declaration_statement\",\"identifier\":\"" << let_stmt->ident.value.value() << "\",\"expression\":";
-                stream << parser.expr_to_string(let_stmt->expr);
-                stream << "}";
-            }
-            void operator()(const NodeScope* scope) const {
-                stream << "{\"type\":\"scope\",\"body\":[";
-                for (int i = 0; i < scope->stmts.size(); i++) {
-                    stream << parser.stmt_to_string(scope->stmts.at(i));
-                }
-                stream << "]}";
+    // Tokens not yet consumed sit in a ring buffer. No rule looks more than a couple
+    // of tokens ahead, but the buffer is topped up in batches so pulling from the
+    // tokenizer (and timing it) costs little per token.
+    [[nodiscard]] inline std::optional<Token> peek(size_t offset = 0)
+    {
+        assert(offset < max_peek);
+        if (m_buffered <= offset) {
+            refill();
+            if (m_buffered <= offset) {
+                return {};
             }
-        };
-        Visitor visitor({.stream=stream,.parser=*this});
-        std::visit(visitor,stmt->var);
-        return stream.str();
-    }
-
-    std::string prog_to_string(const NodeProg program) {
-        std::stringstream stream;
-        stream << "{\"type\":\"program\",\"statements\":[";
-        for (int i = 0; i < program.stmts.size(); i++) {
-            stream << stmt_to_string(program.stmts.at(i));
         }
-        stream << "]}";
-        return stream.str();
+        return m_ring[(m_head + offset) % m_ring.size()];
     }
 
-private:
-    [[nodiscard]] inline std::optional<Token> peek(int offset = 0) const
+    inline Token consume()
     {
-        if (m_index + offset >= m_tokens.size()) {
-            return {};
-        }
-        else {
-            return m_tokens.at(m_index + offset);
-        }
+        Token token = peek().value();
+        m_head = (m_head + 1) % m_ring.size();
+        m_buffered--;
+        return token;
     }
 
-    inline Token consume()
+    inline void refill()
     {
-        return m_tokens.at(m_index++);
+        ProfileScope scope(m_profiler, "tokenize");
+        while (!m_tokens_done && m_buffered < m_ring.size()) {
+            std::optional<Token> token = m_tokenizer.next();
+            if (!token.has_value()) {
+                m_tokens_done = true;
+                break;
+            }
+            m_ring[(m_head + m_buffered) % m_ring.size()] = token.value();
+            m_buffered++;
+            m_token_count++;
+        }
     }
 
     inline Token try_consume(TokenType type, const std::string& err_msg)
@@ -487,8 +506,7 @@ private:
             return consume();
         }
         else {
-            std::cerr << err_msg << std::endl;
-            exit(EXIT_FAILURE);
+            compile_error(err_msg);
         }
     }
 
@@ -502,7 +520,20 @@ private:
         }
     }
 
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    static constexpr size_t max_peek = 4;
+
+    Tokenizer& m_tokenizer;
+    std::array<Token, 256> m_ring {};
+    size_t m_head = 0;
+    size_t m_buffered = 0;
+    bool m_tokens_done = false;
+    size_t m_token_count = 0;
+    Profiler* m_profiler = nullptr;
+    std::optional<ArenaAllocator> m_owned_allocator;
+    ArenaAllocator& m_allocator;
+    std::vector<NodeStmt*> m_stmt_scratch;
+    std::vector<NodeExpr*> m_expr_scratch;
+    std::vector<Token> m_param_scratch;
+    size_t m_scope_depth = 0;
+    bool m_in_function = false;
 };
\ No newline at end of file
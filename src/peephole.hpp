@@ -0,0 +1,303 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "./instructions.hpp"
+
+// Local rewrites over Generator's instruction list, run until nothing changes:
+//  - push-pop:          `push X ... pop Y` becomes `mov Y, X` when the code in between
+//                       leaves Y and the stack alone
+//  - dead-move:         a `mov` into a register that is overwritten before it is read
+//                       is dropped, and `mov A, X; mov B, A` / `mov A, X; push A`
+//                       read X directly when A is dead afterwards
+//  - self-move:         `mov r, r` and `xchg r, r`
+//  - zero-stack-adjust: `add rsp, 0` and `sub rsp, 0`
+//  - jump-to-next:      a `jmp` to the label right after it
+
+enum class PeepholeRule : uint8_t {
+    push_pop,
+    dead_move,
+    self_move,
+    zero_stack_adjust,
+    jump_to_next,
+};
+
+constexpr size_t peephole_rule_count = 5;
+
+inline const char* peephole_rule_name(PeepholeRule rule)
+{
+    static constexpr const char* names[] = { "push-pop", "dead-move", "self-move", "zero-stack-adjust", "jump-to-next" };
+    return names[static_cast<int>(rule)];
+}
+
+inline std::optional<PeepholeRule> peephole_rule_from_name(std::string_view name)
+{
+    for (size_t i = 0; i < peephole_rule_count; i++) {
+        if (name == peephole_rule_name(static_cast<PeepholeRule>(i))) {
+            return static_cast<PeepholeRule>(i);
+        }
+    }
+    return {};
+}
+
+struct PeepholeOptions {
+    std::array<bool, peephole_rule_count> enabled { true, true, true, true, true };
+
+    [[nodiscard]] inline bool on(PeepholeRule rule) const
+    {
+        return enabled[static_cast<int>(rule)];
+    }
+};
+
+struct PeepholeStats {
+    std::array<size_t, peephole_rule_count> removed {}; // instructions removed by each rule
+};
+
+class Peephole {
+public:
+    inline Peephole(std::vector<Instr>& instrs, PeepholeOptions options)
+        : m_instrs(instrs)
+        , m_options(options)
+    {
+    }
+
+    inline PeepholeStats run()
+    {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 0; i < m_instrs.size(); i++) {
+                changed |= rewrite(i);
+            }
+            std::erase_if(m_instrs, [](const Instr& instr) { return instr.op == Op::nop; });
+        }
+        return m_stats;
+    }
+
+private:
+    struct Effects {
+        uint32_t reads = 0;
+        uint32_t writes = 0;
+        bool barrier = false; // control flow, a call or a syscall: assume every register is live
+    };
+
+    static uint32_t bit(Reg reg)
+    {
+        return 1u << static_cast<int>(reg);
+    }
+
+    // registers needed to evaluate an operand (a memory operand needs its base and index)
+    static uint32_t uses(const Operand& operand)
+    {
+        if (operand.kind == Operand::Kind::mem && operand.scale != 0) {
+            return bit(operand.reg) | bit(operand.index);
+        }
+        return operand.kind == Operand::Kind::reg || operand.kind == Operand::Kind::mem ? bit(operand.reg) : 0;
+    }
+
+    static uint32_t reg_of(const Operand& operand)
+    {
+        return operand.kind == Operand::Kind::reg ? bit(operand.reg) : 0;
+    }
+
+    static Effects effects(const Instr& instr)
+    {
+        uint32_t dst_addr = instr.dst.kind == Operand::Kind::mem ? bit(instr.dst.reg) : 0;
+        switch (instr.op) {
+        case Op::nop:
+        case Op::comment:
+            return {};
+        case Op::label:
+        case Op::jz:
+        case Op::jae:
+        case Op::jbe:
+        case Op::jmp:
+        case Op::call:
+        case Op::ret:
+        case Op::syscall:
+            return { .barrier = true };
+        case Op::mov:
+        case Op::lea:
+        case Op::movzx:
+            return { .reads = uses(instr.src) | dst_addr, .writes = reg_of(instr.dst) };
+        case Op::push:
+            return { .reads = uses(instr.dst) | bit(Reg::rsp), .writes = bit(Reg::rsp) };
+        case Op::pop:
+            return { .reads = bit(Reg::rsp), .writes = reg_of(instr.dst) | bit(Reg::rsp) };
+        case Op::test:
+        case Op::cmp:
+            return { .reads = uses(instr.dst) | uses(instr.src) };
+        case Op::mul:
+            return { .reads = bit(Reg::rax) | uses(instr.dst), .writes = bit(Reg::rax) | bit(Reg::rdx) };
+        case Op::div:
+            return { .reads = bit(Reg::rax) | bit(Reg::rdx) | uses(instr.dst), .writes = bit(Reg::rax) | bit(Reg::rdx) };
+        default:
+            // two-operand arithmetic, neg, xchg and setcc read and write their destination
+            return { .reads = uses(instr.dst) | uses(instr.src), .writes = reg_of(instr.dst) | (instr.op == Op::xchg ? reg_of(instr.src) : 0) };
+        }
+    }
+
+    // index of the next instruction after `i` that is not a comment or nop
+    [[nodiscard]] std::optional<size_t> next(size_t i) const
+    {
+        for (size_t j = i + 1; j < m_instrs.size(); j++) {
+            if (m_instrs[j].op != Op::comment && m_instrs[j].op != Op::nop) {
+                return j;
+            }
+        }
+        return {};
+    }
+
+    // True if `reg` is overwritten after instruction `i` before anything reads it.
+    [[nodiscard]] bool dead_after(size_t i, Reg reg) const
+    {
+        constexpr size_t window = 64;
+        for (size_t j = i + 1; j < m_instrs.size() && j <= i + window; j++) {
+            Effects effect = effects(m_instrs[j]);
+            if (effect.barrier || effect.reads & bit(reg)) {
+                return false;
+            }
+            if (effect.writes & bit(reg)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void remove(size_t i, PeepholeRule rule)
+    {
+        m_instrs[i].op = Op::nop;
+        m_stats.removed[static_cast<int>(rule)]++;
+    }
+
+    bool rewrite(size_t i)
+    {
+        Instr& instr = m_instrs[i];
+        switch (instr.op) {
+        case Op::mov:
+        case Op::xchg:
+            if (m_options.on(PeepholeRule::self_move) && instr.dst.kind == Operand::Kind::reg && instr.dst == instr.src) {
+                remove(i, PeepholeRule::self_move);
+                return true;
+            }
+            return instr.op == Op::mov && m_options.on(PeepholeRule::dead_move) && rewrite_move(i);
+        case Op::add:
+        case Op::sub:
+            if (m_options.on(PeepholeRule::zero_stack_adjust) && instr.dst.is_reg(Reg::rsp) && instr.src == imm_op(0)) {
+                remove(i, PeepholeRule::zero_stack_adjust);
+                return true;
+            }
+            return false;
+        case Op::push:
+            return m_options.on(PeepholeRule::push_pop) && rewrite_push(i);
+        case Op::jmp: {
+            std::optional<size_t> j = next(i);
+            if (m_options.on(PeepholeRule::jump_to_next) && j.has_value() && m_instrs[j.value()].op == Op::label
+                && m_instrs[j.value()].dst == instr.dst) {
+                remove(i, PeepholeRule::jump_to_next);
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+        }
+    }
+
+    bool rewrite_move(size_t i)
+    {
+        Instr& move = m_instrs[i];
+        if (move.dst.kind != Operand::Kind::reg || move.dst.reg == Reg::rsp) {
+            return false;
+        }
+        Reg reg = move.dst.reg;
+        if (dead_after(i, reg)) {
+            remove(i, PeepholeRule::dead_move);
+            return true;
+        }
+        std::optional<size_t> j = next(i);
+        if (!j.has_value()) {
+            return false;
+        }
+        Instr& user = m_instrs[j.value()];
+        bool forwards_to_move = user.op == Op::mov && user.dst.kind == Operand::Kind::reg && user.src.is_reg(reg);
+        // push only takes a sign-extended 32-bit immediate
+        bool forwards_to_push = user.op == Op::push && user.dst.is_reg(reg)
+            && (move.src.kind != Operand::Kind::imm || fits_imm32(move.src.value));
+        if (!(forwards_to_move || forwards_to_push) || !dead_after(j.value(), reg)) {
+            return false;
+        }
+        (forwards_to_move ? user.src : user.dst) = move.src;
+        remove(i, PeepholeRule::dead_move);
+        return true;
+    }
+
+    // push X; <code not touching Y or the stack>; pop Y  =>  mov Y, X; <code>
+    bool rewrite_push(size_t i)
+    {
+        constexpr size_t window = 32;
+        std::optional<size_t> pop;
+        for (size_t j = i + 1; j < m_instrs.size() && j <= i + window; j++) {
+            const Instr& instr = m_instrs[j];
+            if (instr.op == Op::pop) {
+                pop = j;
+                break;
+            }
+            if (instr.op == Op::push || effects(instr).barrier || effects(instr).writes & bit(Reg::rsp)) {
+                return false;
+            }
+        }
+        if (!pop.has_value()) {
+            return false;
+        }
+        Reg reg = m_instrs[pop.value()].dst.reg;
+        for (size_t j = i + 1; j < pop.value(); j++) {
+            const Instr& instr = m_instrs[j];
+            Effects effect = effects(instr);
+            if ((effect.reads | effect.writes) & bit(reg)) {
+                return false;
+            }
+            // the pushed slot itself must not be read; anything above it is fine
+            for (const Operand* operand : { &instr.dst, &instr.src }) {
+                if (operand->kind == Operand::Kind::mem && operand->reg == Reg::rsp && operand->value < 8) {
+                    return false;
+                }
+            }
+        }
+        // without the push everything above the slot is 8 bytes closer to rsp
+        for (size_t j = i + 1; j < pop.value(); j++) {
+            for (Operand* operand : { &m_instrs[j].dst, &m_instrs[j].src }) {
+                if (operand->kind == Operand::Kind::mem && operand->reg == Reg::rsp) {
+                    operand->value -= 8;
+                }
+            }
+        }
+        if (m_instrs[i].dst.is_reg(reg)) {
+            remove(i, PeepholeRule::push_pop);
+        }
+        else {
+            m_instrs[i] = { .op = Op::mov, .dst = reg_op(reg), .src = m_instrs[i].dst };
+        }
+        remove(pop.value(), PeepholeRule::push_pop);
+        return true;
+    }
+
+    static bool fits_imm32(int64_t value)
+    {
+        return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+    }
+
+    std::vector<Instr>& m_instrs;
+    const PeepholeOptions m_options;
+    PeepholeStats m_stats {};
+};
+
+inline PeepholeStats peephole(std::vector<Instr>& instrs, PeepholeOptions options = {})
+{
+    return Peephole(instrs, options).run();
+}
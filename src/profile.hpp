@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "./output.hpp"
+
+// Collects wall and CPU time per compiler phase plus a few counters, for
+// --time-report and Chrome trace export. Phases nest: a phase started while
+// another is running is reported under it. Phases that run in many small pieces
+// (tokenizing as the parser pulls tokens, everything per statement in streaming
+// mode) add up under one name; only the first `max_events` pieces are kept for
+// the trace.
+class Profiler {
+public:
+    static constexpr size_t max_events = 100000;
+
+    inline Profiler()
+        : m_start(now())
+    {
+    }
+
+    // adds `value` to the counter `name`
+    inline void count(std::string_view name, uint64_t value)
+    {
+        for (Counter& counter : m_counters) {
+            if (counter.name == name) {
+                counter.value += value;
+                return;
+            }
+        }
+        m_counters.push_back({ .name = std::string(name), .value = value });
+    }
+
+    // keeps the largest value seen for `name`
+    inline void high_water(std::string_view name, uint64_t value)
+    {
+        for (Counter& counter : m_counters) {
+            if (counter.name == name) {
+                counter.value = std::max(counter.value, value);
+                return;
+            }
+        }
+        m_counters.push_back({ .name = std::string(name), .value = value });
+    }
+
+    // Prints one line per phase, children indented under their parent, then the
+    // counters and the peak resident set size.
+    inline void report(std::ostream& out) const
+    {
+        out << std::left << std::setw(28) << "phase" << std::right << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms" << std::setw(10) << "calls" << "\n";
+        for (const Phase& phase : m_phases) {
+            std::string label = std::string(2 * phase.depth, ' ') + phase.name;
+            out << std::left << std::setw(28) << label << std::right << std::fixed << std::setprecision(3)
+                << std::setw(12) << phase.wall_ns / 1e6 << std::setw(12) << phase.cpu_ns / 1e6
+                << std::setw(10) << phase.calls << "\n";
+        }
+        for (const Counter& counter : m_counters) {
+            out << counter.name << ": " << counter.value << "\n";
+        }
+        rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+        out << "peak rss: " << usage.ru_maxrss << " KB" << std::endl;
+    }
+
+    // Chrome trace_event JSON: one complete ("X") event per recorded phase, with
+    // its CPU time as an argument.
+    inline void write_trace(OutputSink& out) const
+    {
+        out << "{\"traceEvents\":[";
+        for (size_t i = 0; i < m_events.size(); i++) {
+            const Event& event = m_events[i];
+            out << (i == 0 ? "\n" : ",\n");
+            out << "{\"name\":\"" << m_phases[event.phase].name << "\",\"cat\":\"dum\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":";
+            write_micros(out, event.start_ns);
+            out << ",\"dur\":";
+            write_micros(out, event.wall_ns);
+            out << ",\"args\":{\"cpu_us\":";
+            write_micros(out, event.cpu_ns);
+            out << "}}";
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"";
+        for (const Counter& counter : m_counters) {
+            if (&counter == &m_counters.front()) {
+                out << ",\"otherData\":{";
+            }
+            out << "\"" << counter.name << "\":" << static_cast<int64_t>(counter.value);
+            out << (&counter == &m_counters.back() ? "}" : ",");
+        }
+        out << "}\n";
+    }
+
+private:
+    friend class ProfileScope;
+
+    struct Phase {
+        std::string name;
+        size_t parent; // index in m_phases, or npos at the top
+        size_t depth;
+        int64_t wall_ns = 0;
+        int64_t cpu_ns = 0;
+        uint64_t calls = 0;
+    };
+
+    struct Event {
+        size_t phase;
+        int64_t start_ns;
+        int64_t wall_ns;
+        int64_t cpu_ns;
+    };
+
+    struct Counter {
+        std::string name;
+        uint64_t value;
+    };
+
+    static constexpr size_t npos = SIZE_MAX;
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t cpu_now()
+    {
+        timespec ts {};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    static void write_micros(OutputSink& out, int64_t ns)
+    {
+        char frac[4] = { static_cast<char>('0' + ns / 100 % 10), static_cast<char>('0' + ns / 10 % 10), static_cast<char>('0' + ns % 10), '\0' };
+        out << ns / 1000 << "." << frac;
+    }
+
+    // the phase called `name` under the one currently running, created on first use
+    inline size_t enter(std::string_view name)
+    {
+        for (size_t i = 0; i < m_phases.size(); i++) {
+            if (m_phases[i].parent == m_current && m_phases[i].name == name) {
+                m_current = i;
+                return i;
+            }
+        }
+        size_t depth = m_current == npos ? 0 : m_phases[m_current].depth + 1;
+        m_phases.push_back({ .name = std::string(name), .parent = m_current, .depth = depth });
+        m_current = m_phases.size() - 1;
+        return m_current;
+    }
+
+    inline void leave(size_t phase, int64_t start, int64_t wall, int64_t cpu)
+    {
+        Phase& entry = m_phases[phase];
+        entry.wall_ns += wall;
+        entry.cpu_ns += cpu;
+        entry.calls++;
+        m_current = entry.parent;
+        if (m_events.size() < max_events) {
+            m_events.push_back({ .phase = phase, .start_ns = start - m_start, .wall_ns = wall, .cpu_ns = cpu });
+        }
+    }
+
+    int64_t m_start;
+    size_t m_current = npos;
+    std::vector<Phase> m_phases;
+    std::vector<Event> m_events;
+    std::vector<Counter> m_counters;
+};
+
+// Times the enclosing block as the phase `name`. Does nothing without a profiler,
+// so call sites don't need to check.
+class ProfileScope {
+public:
+    inline ProfileScope(Profiler* profiler, std::string_view name)
+        : m_profiler(profiler)
+    {
+        if (m_profiler != nullptr) {
+            m_phase = m_profiler->enter(name);
+            m_cpu_start = Profiler::cpu_now();
+            m_start = Profiler::now();
+        }
+    }
+
+    inline ProfileScope(const ProfileScope& other) = delete;
+
+    inline ProfileScope operator=(const ProfileScope& other) = delete;
+
+    inline ~ProfileScope()
+    {
+        if (m_profiler != nullptr) {
+            int64_t wall = Profiler::now() - m_start;
+            m_profiler->leave(m_phase, m_start, wall, Profiler::cpu_now() - m_cpu_start);
+        }
+    }
+
+private:
+    Profiler* m_profiler;
+    size_t m_phase = 0;
+    int64_t m_start = 0;
+    int64_t m_cpu_start = 0;
+};
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view over a source file. Regular files are mapped straight into
+// memory; pipes, character devices and stdin (`-`) fall back to a single read
+// into one buffer. Either way the contents live until the SourceFile dies.
+class SourceFile {
+public:
+    inline explicit SourceFile(const std::string& path)
+    {
+        int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+                m_mapped = static_cast<const char*>(mapped);
+                m_size = st.st_size;
+                m_ok = true;
+            }
+        }
+        if (!m_ok) {
+            m_ok = read_all(fd, S_ISREG(st.st_mode) ? st.st_size : 0);
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+
+    inline SourceFile(const SourceFile& other) = delete;
+
+    inline SourceFile operator=(const SourceFile& other) = delete;
+
+    inline ~SourceFile()
+    {
+        if (m_mapped != nullptr) {
+            munmap(const_cast<char*>(m_mapped), m_size);
+        }
+    }
+
+    [[nodiscard]] inline bool ok() const
+    {
+        return m_ok;
+    }
+
+    [[nodiscard]] inline std::string_view view() const
+    {
+        if (m_mapped != nullptr) {
+            return { m_mapped, m_size };
+        }
+        return m_buffer;
+    }
+
+private:
+    inline bool read_all(int fd, size_t size_hint)
+    {
+        m_buffer.resize(size_hint > 0 ? size_hint : 64 * 1024);
+        size_t used = 0;
+        while (true) {
+            if (used == m_buffer.size()) {
+                m_buffer.resize(m_buffer.size() * 2);
+            }
+            ssize_t n = read(fd, m_buffer.data() + used, m_buffer.size() - used);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
+                break;
+            }
+            used += n;
+        }
+        m_buffer.resize(used);
+        return true;
+    }
+
+    const char* m_mapped = nullptr;
+    size_t m_size = 0;
+    std::string m_buffer;
+    bool m_ok = false;
+};
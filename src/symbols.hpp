@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Maps each distinct identifier to a dense integer id, so later phases compare and
+// index names instead of hashing or comparing strings. The names are views into the
+// source buffer, which has to outlive the interner.
+class Interner {
+public:
+    inline uint32_t intern(std::string_view name)
+    {
+        auto [it, inserted] = m_ids.try_emplace(name, static_cast<uint32_t>(m_names.size()));
+        if (inserted) {
+            m_names.push_back(name);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] inline std::string_view name(uint32_t symbol) const
+    {
+        return m_names[symbol];
+    }
+
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_names.size();
+    }
+
+private:
+    std::unordered_map<std::string_view, uint32_t> m_ids;
+    std::vector<std::string_view> m_names;
+};
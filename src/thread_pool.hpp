@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a batch of independent tasks on a fixed number of threads. Every worker
+// starts with its own contiguous share of the task indices and works through it
+// from the back; a worker that runs dry steals from the front of the others'
+// queues, so a few slow tasks don't leave the rest of the threads idle.
+class WorkStealingPool {
+public:
+    // 0 picks one thread per core
+    inline explicit WorkStealingPool(size_t threads = 0)
+        : m_threads(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    {
+    }
+
+    [[nodiscard]] inline size_t threads() const
+    {
+        return m_threads;
+    }
+
+    // Calls task(worker, index) for every index in [0, count) and waits for all of
+    // them. `worker` is in [0, threads()) and never runs two tasks at once, so it
+    // can index per-thread state.
+    template <typename Task>
+    void run(size_t count, Task task)
+    {
+        size_t workers = std::min(m_threads, std::max<size_t>(count, 1));
+        std::vector<std::unique_ptr<Queue>> queues;
+        for (size_t w = 0; w < workers; w++) {
+            auto queue = std::make_unique<Queue>();
+            for (size_t i = count * w / workers; i < count * (w + 1) / workers; i++) {
+                queue->tasks.push_back(i);
+            }
+            queues.push_back(std::move(queue));
+        }
+        std::vector<std::jthread> threads;
+        for (size_t w = 0; w < workers; w++) {
+            threads.emplace_back([&, w] {
+                while (std::optional<size_t> index = next(queues, w)) {
+                    task(w, index.value());
+                }
+            });
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    // Nothing is queued once the batch has started, so a worker can stop as soon
+    // as every queue it looks at is empty.
+    static std::optional<size_t> next(std::vector<std::unique_ptr<Queue>>& queues, size_t worker)
+    {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            size_t index;
+            if (i == 0) {
+                index = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            else {
+                index = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            return index;
+        }
+        return {};
+    }
+
+    size_t m_threads;
+};
\ No newline at end of file
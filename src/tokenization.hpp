@@ -1,10 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <iostream>
 
+#include "./char_scan.hpp"
+#include "./compile_error.hpp"
+#include "./symbols.hpp"
+
 enum class TokenType {
     exit,         // 0
     int_lit,      // 1
@@ -25,171 +33,277 @@ enum class TokenType {
     comma,        // 16
     greater_than, // 17
     less_than,    // 18
+    return_,      // 19
+};
+
+// Everything the lexer and parser know about each token type, in TokenType order.
+// The name table, the precedence table, the character dispatch table and the
+// keyword hash below are all generated from this at compile time, so adding a
+// token is one line here (and one in the enum).
+struct TokenSpec {
+    TokenType type;
+    const char* name; // as printed by -tk
+    // The spelling of a keyword or single-character punctuation. Empty for tokens
+    // lexed some other way, or not lexed yet.
+    std::string_view text {};
+    int prec = -1; // binary operator precedence, -1 if not a binary operator
+};
+
+inline constexpr TokenSpec token_spec[] = {
+    { .type = TokenType::exit, .name = "exit", .text = "exit" },
+    { .type = TokenType::int_lit, .name = "int_lit" },
+    { .type = TokenType::semicolon, .name = "semicolon", .text = ";" },
+    { .type = TokenType::open_paren, .name = "open_paren", .text = "(" },
+    { .type = TokenType::close_paren, .name = "close_paren", .text = ")" },
+    { .type = TokenType::ident, .name = "ident" },
+    { .type = TokenType::let, .name = "let", .text = "let" },
+    { .type = TokenType::equals, .name = "equals", .text = "=" },
+    { .type = TokenType::plus, .name = "plus", .text = "+", .prec = 1 },
+    { .type = TokenType::star, .name = "star", .text = "*", .prec = 2 },
+    { .type = TokenType::dash, .name = "dash", .text = "-", .prec = 1 },
+    { .type = TokenType::fslash, .name = "fslash", .text = "/", .prec = 2 },
+    { .type = TokenType::open_brace, .name = "open_brace", .text = "{" },
+    { .type = TokenType::close_brace, .name = "close_brace", .text = "}" },
+    { .type = TokenType::if_, .name = "if_", .text = "if" },
+    { .type = TokenType::function, .name = "function", .text = "function" },
+    { .type = TokenType::comma, .name = "comma", .text = "," },
+    { .type = TokenType::greater_than, .name = "greater_than", .text = ">", .prec = 0 }, // 14 + 4 > 8 + 7 -> 18 > 15 -> 1
+    { .type = TokenType::less_than, .name = "less_than", .text = "<", .prec = 0 },
+    { .type = TokenType::return_, .name = "return_", .text = "return" },
+};
+
+inline constexpr size_t token_type_count = std::size(token_spec);
+
+namespace token_tables {
+
+inline constexpr bool is_keyword(const TokenSpec& spec)
+{
+    return !spec.text.empty() && char_class::is(spec.text[0], char_class::alpha);
+}
+
+inline constexpr bool is_punct(const TokenSpec& spec)
+{
+    return !spec.text.empty() && !is_keyword(spec);
+}
+
+inline constexpr bool spec_is_valid()
+{
+    for (size_t i = 0; i < token_type_count; i++) {
+        const TokenSpec& spec = token_spec[i];
+        if (static_cast<size_t>(spec.type) != i) {
+            return false;
+        }
+        if (is_punct(spec) && spec.text.size() != 1) {
+            return false;
+        }
+        for (char c : spec.text) {
+            if (is_keyword(spec) && !char_class::is(c, char_class::alpha | char_class::digit)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(spec_is_valid(), "token_spec must list every TokenType in order, with one-character punctuation and alphanumeric keywords");
+
+// What the lexer does on seeing a byte at the start of a token.
+enum class Lex : uint8_t {
+    invalid,
+    space,
+    word, // identifier or keyword
+    number,
+    punct, // a one-character token of type `type`
 };
 
-const char* TokenTypes[] = {
-    "exit",         // 0
-    "int_lit",      // 1
-    "semicolon",    // 2
-    "open_paren",   // 3
-    "close_paren",  // 4
-    "ident",        // 5
-    "let",          // 6
-    "equals",       // 7
-    "plus",         // 8
-    "star",         // 9
-    "dash",         // 10
-    "fslash",       // 11
-    "open_brace",   // 12
-    "close_brace",  // 13
-    "if_",          // 14
-    "function",     // 15
-    "comma",        // 16
-    "greater_than", // 17
-    "less_than",    // 18
+struct CharAction {
+    Lex lex = Lex::invalid;
+    TokenType type {};
 };
 
-std::optional<int> bin_prec(TokenType type)
+inline constexpr std::array<CharAction, 256> char_actions = [] {
+    std::array<CharAction, 256> actions {};
+    for (size_t c = 0; c < 256; c++) {
+        if (char_class::is(static_cast<char>(c), char_class::space)) {
+            actions[c].lex = Lex::space;
+        }
+        else if (char_class::is(static_cast<char>(c), char_class::alpha)) {
+            actions[c].lex = Lex::word;
+        }
+        else if (char_class::is(static_cast<char>(c), char_class::digit)) {
+            actions[c].lex = Lex::number;
+        }
+    }
+    for (const TokenSpec& spec : token_spec) {
+        if (is_punct(spec)) {
+            actions[static_cast<uint8_t>(spec.text[0])] = { .lex = Lex::punct, .type = spec.type };
+        }
+    }
+    return actions;
+}();
+
+// Keywords are found with a perfect hash of their first and last byte and their
+// length, with a multiplier searched for at compile time so that no two keywords
+// share a slot. A word is then a keyword only if it equals the one in its slot.
+inline constexpr size_t keyword_bits = 4;
+
+inline constexpr uint32_t keyword_hash(std::string_view word, uint32_t multiplier)
 {
-    switch (type) {
-    case TokenType::dash:
-    case TokenType::plus:
-        return 0;
-    case TokenType::fslash:
-        return 1;
-    case TokenType::star:
-        return 2;
-    case TokenType::greater_than: // 14 + 4 > 8 + 7 -> 18 > 15 -> 1
-    case TokenType::less_than:
-        return 3;
-    default:
+    uint32_t key = static_cast<uint8_t>(word.front()) << 16 | static_cast<uint8_t>(word.back()) << 8 | static_cast<uint8_t>(word.size());
+    return (key * multiplier) >> (32 - keyword_bits);
+}
+
+inline constexpr uint32_t keyword_multiplier = [] {
+    for (uint32_t multiplier = 0x9e3779b1;; multiplier += 2) {
+        bool used[1 << keyword_bits] {};
+        bool perfect = true;
+        for (const TokenSpec& spec : token_spec) {
+            if (is_keyword(spec)) {
+                uint32_t slot = keyword_hash(spec.text, multiplier);
+                perfect = perfect && !used[slot];
+                used[slot] = true;
+            }
+        }
+        if (perfect) {
+            return multiplier;
+        }
+    }
+}();
+
+struct KeywordSlot {
+    std::string_view text {}; // empty if no keyword hashes here
+    TokenType type {};
+};
+
+inline constexpr std::array<KeywordSlot, 1 << keyword_bits> keyword_slots = [] {
+    std::array<KeywordSlot, 1 << keyword_bits> slots {};
+    for (const TokenSpec& spec : token_spec) {
+        if (is_keyword(spec)) {
+            slots[keyword_hash(spec.text, keyword_multiplier)] = { .text = spec.text, .type = spec.type };
+        }
+    }
+    return slots;
+}();
+
+// the keyword spelled `word`, if it is one
+inline constexpr std::optional<TokenType> keyword(std::string_view word)
+{
+    const KeywordSlot& slot = keyword_slots[keyword_hash(word, keyword_multiplier)];
+    if (slot.text == word) {
+        return slot.type;
+    }
+    return {};
+}
+
+inline constexpr std::array<int, token_type_count> precs = [] {
+    std::array<int, token_type_count> table {};
+    for (const TokenSpec& spec : token_spec) {
+        table[static_cast<size_t>(spec.type)] = spec.prec;
+    }
+    return table;
+}();
+
+} // namespace token_tables
+
+// read-only, so concurrent compiles can share it
+inline constexpr std::array<const char*, token_type_count> TokenTypes = [] {
+    std::array<const char*, token_type_count> names {};
+    for (const TokenSpec& spec : token_spec) {
+        names[static_cast<size_t>(spec.type)] = spec.name;
+    }
+    return names;
+}();
+
+inline constexpr std::optional<int> bin_prec(TokenType type)
+{
+    int prec = token_tables::precs[static_cast<size_t>(type)];
+    if (prec < 0) {
         return {};
     }
+    return prec;
 }
 
+// `value` is a slice of the source buffer handed to the Tokenizer, so that
+// buffer has to outlive every token (and every AST node holding a token).
 struct Token {
     TokenType type;
-    std::optional<std::string> value {};
+    std::optional<std::string_view> value {};
+    uint32_t symbol = 0; // interned id of an identifier
 };
 
 class Tokenizer {
 public:
-    inline explicit Tokenizer(std::string src)
-        : m_src(std::move(src))
+    // identifiers are interned into `symbols` as they are read; runs of whitespace,
+    // identifier characters and digits are skipped with `scanner`
+    inline Tokenizer(std::string_view src, Interner& symbols, const CharScanner& scanner = CharScanner::best())
+        : m_src(src)
+        , m_symbols(symbols)
+        , m_scanner(scanner)
     {
     }
 
     inline std::vector<Token> tokenize()
     {
         std::vector<Token> tokens;
-        std::string buf;
-        while (peek().has_value()) {
-            if (std::isalpha(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit") {
-                    tokens.push_back({ .type = TokenType::exit });
-                    buf.clear();
-                }
-                else if (buf == "function") {
-                    tokens.push_back({ .type = TokenType::function });
-                    buf.clear();
-                }
-                else if (buf == "let") {
-                    tokens.push_back({ .type = TokenType::let });
-                    buf.clear();
-                }
-                else if (buf == "if") {
-                    tokens.push_back({ .type = TokenType::if_ });
-                    buf.clear();
-                }
-                else {
-                    tokens.push_back({ .type = TokenType::ident, .value = buf });
-                    buf.clear();
-                }
-            }
-            else if (std::isdigit(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({ .type = TokenType::int_lit, .value = buf });
-                buf.clear();
-            }
-            else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({ .type = TokenType::open_paren });
-            }
-            else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({ .type = TokenType::close_paren });
-            }
-            else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({ .type = TokenType::semicolon });
-            }
-            else if (peek().value() == ',') {
-                consume();
-                tokens.push_back({ .type = TokenType::comma });
-            }
-            else if (peek().value() == '=') {
-                consume();
-                tokens.push_back({ .type = TokenType::equals });
-            }
-            else if (peek().value() == '+') {
-                consume();
-                tokens.push_back({ .type = TokenType::plus });
-            }
-            else if (peek().value() == '*') {
-                consume();
-                tokens.push_back({ .type = TokenType::star });
-            }
-            else if (peek().value() == '-') {
-                consume();
-                tokens.push_back({ .type = TokenType::dash });
-            }
-            else if (peek().value() == '/') {
-                consume();
-                tokens.push_back({ .type = TokenType::fslash });
-            }
-            else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({ .type = TokenType::open_brace });
-            }
-            else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({ .type = TokenType::close_brace });
-            }
-            else if (std::isspace(peek().value())) {
-                consume();
-            }
-            else {
-                std::cerr << "`" << peek().value() << "` is not a proper token!! Add the token or just get better!" << std::endl;
-                exit(EXIT_FAILURE);
-            }
+        while (std::optional<Token> token = next()) {
+            tokens.push_back(token.value());
         }
         m_index = 0;
         return tokens;
     }
 
-private:
-    [[nodiscard]] inline std::optional<char> peek(int offset = 0) const
+    // The next token in the source, or nullopt at the end. Lets a consumer pull
+    // tokens one at a time instead of holding the whole file's worth.
+    inline std::optional<Token> next()
     {
-        if (m_index + offset >= m_src.length()) {
-            return {};
-        }
-        else {
-            return m_src.at(m_index + offset);
+        while (m_index < m_src.size()) {
+            char c = m_src[m_index];
+            const token_tables::CharAction& action = token_tables::char_actions[static_cast<uint8_t>(c)];
+            switch (action.lex) {
+            case token_tables::Lex::space:
+                m_index = run_end(m_index + 1, char_class::space, m_scanner.space);
+                break;
+            case token_tables::Lex::word: {
+                size_t start = m_index;
+                m_index = run_end(m_index + 1, char_class::alpha | char_class::digit, m_scanner.alnum);
+                std::string_view buf = m_src.substr(start, m_index - start);
+                if (std::optional<TokenType> keyword = token_tables::keyword(buf)) {
+                    return Token { .type = keyword.value() };
+                }
+                return Token { .type = TokenType::ident, .value = buf, .symbol = m_symbols.intern(buf) };
+            }
+            case token_tables::Lex::number: {
+                size_t start = m_index;
+                m_index = run_end(m_index + 1, char_class::digit, m_scanner.digits);
+                return Token { .type = TokenType::int_lit, .value = m_src.substr(start, m_index - start) };
+            }
+            case token_tables::Lex::punct:
+                m_index++;
+                return Token { .type = action.type };
+            case token_tables::Lex::invalid:
+                compile_error("`", c, "` is not a proper token!! Add the token or just get better!");
+            }
         }
+        return {};
     }
 
-    inline char consume()
+private:
+    // Most runs are only a few bytes long, and handing those to the scanner costs
+    // more than it saves, so the first few bytes are checked here.
+    inline size_t run_end(size_t index, uint8_t classes, const char* (*scan)(const char*, const char*)) const
     {
-        return m_src.at(m_index++);
+        size_t inline_end = std::min(index + 8, m_src.size());
+        while (index < inline_end) {
+            if (!char_class::is(m_src[index], classes)) {
+                return index;
+            }
+            index++;
+        }
+        return scan(m_src.data() + index, m_src.data() + m_src.size()) - m_src.data();
     }
 
-    const std::string m_src;
+    const std::string_view m_src;
+    Interner& m_symbols;
+    const CharScanner& m_scanner;
     size_t m_index = 0;
 };
\ No newline at end of file
@@ -0,0 +1,14 @@
+# cmake -DDUM=... -DPYTHON=... -DPROGRAM=... -DFLAGS=... -P check_ast.cmake
+# The tree printed by -ast has to parse as JSON. CMake's own JSON parser takes
+# numbers with leading zeros, so Python's stricter one reads it instead.
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+execute_process(COMMAND "${DUM}" "${PROGRAM}" -ast ${flags}
+    COMMAND "${PYTHON}" -c "import json, sys; json.load(sys.stdin)"
+    RESULTS_VARIABLE results
+    ERROR_VARIABLE errors)
+foreach(result IN LISTS results)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "dum ${PROGRAM} -ast ${FLAGS} did not print valid JSON (${results}): ${errors}")
+    endif()
+endforeach()
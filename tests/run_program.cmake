@@ -0,0 +1,32 @@
+# cmake -DDUM=... -DPROGRAM=... -DFLAGS=... -DEXPECTED=... -DWORK_DIR=... -P run_program.cmake
+# With -DEXPECTED_ERROR=... instead of -DEXPECTED, the compile has to fail with
+# that message and leave no assembly behind.
+# dum writes out.asm and out to the working directory, so each test gets its own.
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+execute_process(COMMAND "${DUM}" "${PROGRAM}" -a ${flags}
+    WORKING_DIRECTORY "${WORK_DIR}"
+    RESULT_VARIABLE compile_result
+    ERROR_VARIABLE compile_error)
+if(DEFINED EXPECTED_ERROR)
+    string(FIND "${compile_error}" "${EXPECTED_ERROR}" found)
+    if(compile_result EQUAL 0 OR found EQUAL -1)
+        message(FATAL_ERROR "dum ${PROGRAM} -a ${FLAGS} should fail with '${EXPECTED_ERROR}', got (${compile_result}): ${compile_error}")
+    endif()
+    if(EXISTS "${WORK_DIR}/out.asm")
+        message(FATAL_ERROR "dum ${PROGRAM} -a ${FLAGS} failed but left out.asm behind")
+    endif()
+    return()
+endif()
+if(NOT compile_result EQUAL 0)
+    message(FATAL_ERROR "dum ${PROGRAM} -a ${FLAGS} failed (${compile_result}): ${compile_error}")
+endif()
+
+execute_process(COMMAND "${WORK_DIR}/out"
+    WORKING_DIRECTORY "${WORK_DIR}"
+    RESULT_VARIABLE exit_code)
+if(NOT exit_code STREQUAL "${EXPECTED}")
+    message(FATAL_ERROR "${PROGRAM} with '${FLAGS}' exited with ${exit_code}, expected ${EXPECTED}")
+endif()